@@ -0,0 +1,192 @@
+/*
+ * CPU and NUMA topology helpers for thread_pool's affinity policies.
+ *
+ * The topology comes from /sys/devices/system/node, restricted to the CPUs
+ * this process may run on. Machines (or kernels, or platforms) without that
+ * information are treated as a single node holding every allowed CPU.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+enum class affinity_policy
+{
+    none,       // let the scheduler place workers
+    pinned,     // pin every worker to one CPU, dealt over the nodes in turn
+    numa        // pinned, plus node local queues, buffers and submission
+};
+
+class cpu_topology
+{
+public:
+    static const cpu_topology& get()
+    {
+        static const cpu_topology topology;
+        return topology;
+    }
+
+    /*
+     * Allowed CPUs of every node which has any; never empty.
+     */
+    const std::vector<std::vector<unsigned int>>& nodes() const noexcept
+    {
+        return m_nodes;
+    }
+
+    /*
+     * Index into nodes() of the CPU the calling thread runs on right now.
+     */
+    unsigned int current_node() const noexcept
+    {
+#ifdef __linux__
+        if(m_nodes.size() > 1)
+        {
+            const int cpu = sched_getcpu();
+            if(cpu >= 0 && static_cast<size_t>(cpu) < m_cpuNode.size())
+                return m_cpuNode[cpu];
+        }
+#endif
+        return 0;
+    }
+
+    /*
+     * Restricts the calling thread to a single CPU.
+     */
+    static bool pin(unsigned int cpu) noexcept
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+
+private:
+    cpu_topology()
+    {
+        std::vector<unsigned int> allowed;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(sched_getaffinity(0, sizeof(set), &set) == 0)
+            for(unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if(CPU_ISSET(cpu, &set))
+                    allowed.push_back(cpu);
+
+        for(unsigned int node = 0; ; ++node)
+        {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if(!file)
+                break;
+            std::string list;
+            std::getline(file, list);
+
+            std::vector<unsigned int> cpus;
+            for(auto cpu : parse_cpulist(list))
+                if(std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+                    cpus.push_back(cpu);
+            if(!cpus.empty())
+                m_nodes.push_back(std::move(cpus));
+        }
+#endif
+        if(m_nodes.empty())
+        {
+            if(allowed.empty())
+                for(unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+                    allowed.push_back(cpu);
+            m_nodes.push_back(allowed);
+        }
+
+        for(unsigned int node = 0; node < m_nodes.size(); ++node)
+            for(auto cpu : m_nodes[node])
+            {
+                if(cpu >= m_cpuNode.size())
+                    m_cpuNode.resize(cpu + 1, 0);
+                m_cpuNode[cpu] = node;
+            }
+    }
+
+    /*
+     * "0-3,8,10-11" -> 0 1 2 3 8 10 11
+     */
+    static std::vector<unsigned int> parse_cpulist(const std::string& list)
+    {
+        std::vector<unsigned int> cpus;
+        size_t pos = 0;
+        while(pos < list.size())
+        {
+            auto end = list.find(',', pos);
+            if(end == std::string::npos)
+                end = list.size();
+            const auto range = list.substr(pos, end - pos);
+            const auto dash = range.find('-');
+            try
+            {
+                const auto first = std::stoul(range.substr(0, dash));
+                const auto last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+                for(auto cpu = first; cpu <= last; ++cpu)
+                    cpus.push_back(static_cast<unsigned int>(cpu));
+            }
+            catch(const std::exception&)
+            {
+            }
+            pos = end + 1;
+        }
+        return cpus;
+    }
+
+    std::vector<std::vector<unsigned int>> m_nodes;
+    std::vector<unsigned int> m_cpuNode;
+};
+
+/*
+ * Keeps the calling thread on the CPUs of one node until destroyed, so the
+ * memory it first touches meanwhile is placed on that node.
+ */
+class node_scope
+{
+public:
+    explicit node_scope(unsigned int node) noexcept
+    {
+#ifdef __linux__
+        m_restore = pthread_getaffinity_np(pthread_self(), sizeof(m_saved), &m_saved) == 0;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(auto cpu : cpu_topology::get().nodes()[node])
+            CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)node;
+#endif
+    }
+
+    ~node_scope() noexcept
+    {
+#ifdef __linux__
+        if(m_restore)
+            pthread_setaffinity_np(pthread_self(), sizeof(m_saved), &m_saved);
+#endif
+    }
+
+    node_scope(const node_scope&) = delete;
+    node_scope& operator=(const node_scope&) = delete;
+
+private:
+#ifdef __linux__
+    cpu_set_t m_saved;
+    bool m_restore = false;
+#endif
+};
@@ -0,0 +1,209 @@
+/*
+ * ------------------------------------------------------------------------
+ * Per worker storage, in the spirit of TBB's enumerable_thread_specific
+ * and combinable.
+ *
+ * Every worker of the pool the object was built for owns one cache line
+ * aligned slot, found by its worker_index(), so local() is a thread local
+ * read and an array index with no sharing at all. Threads outside the pool
+ * (the caller of parallel_for, say) get slots of their own from a mutex
+ * protected list, cached per thread after the first lookup.
+ *
+ * local() may be called concurrently, anything else (combine, for_each,
+ * clear) only once the parallel phase is over.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <functional>
+
+template<typename T>
+class enumerable_thread_specific
+{
+public:
+    template<typename Pool>
+    explicit enumerable_thread_specific(const Pool& pool, T exemplar = T())
+    :
+      m_pool(&pool),
+      m_worker([](const void* p) { return static_cast<const Pool*>(p)->worker_index(); }),
+      m_workers(pool.threads()),
+      m_slots(std::make_unique<slot[]>(m_workers)),
+      m_exemplar(std::move(exemplar)),
+      m_id(next_id())
+    {
+    }
+
+    enumerable_thread_specific(const enumerable_thread_specific&) = delete;
+    enumerable_thread_specific& operator=(const enumerable_thread_specific&) = delete;
+
+    /*
+     * The calling thread's value, a copy of the exemplar on first use.
+     */
+    T& local()
+    {
+        const int worker = m_worker(m_pool);
+        auto& s = worker >= 0 && static_cast<unsigned int>(worker) < m_workers ? m_slots[worker] : external();
+        if(!s.value)
+            s.value.emplace(m_exemplar);
+        return *s.value;
+    }
+
+    /*
+     * Number of threads which called local().
+     */
+    size_t size() const
+    {
+        size_t n = 0;
+        for_each([&n](const T&) { ++n; });
+        return n;
+    }
+
+    template<typename F>
+    void for_each(F f)
+    {
+        for(unsigned int i = 0; i < m_workers; ++i)
+            if(m_slots[i].value)
+                f(*m_slots[i].value);
+        for(auto& e : m_external)
+            if(e.second->value)
+                f(*e.second->value);
+    }
+
+    template<typename F>
+    void for_each(F f) const
+    {
+        for(unsigned int i = 0; i < m_workers; ++i)
+            if(m_slots[i].value)
+                f(*m_slots[i].value);
+        for(const auto& e : m_external)
+            if(e.second->value)
+                f(*e.second->value);
+    }
+
+    /*
+     * Folds every value with f, or returns the exemplar if there are none.
+     */
+    template<typename F>
+    T combine(F f) const
+    {
+        std::optional<T> result;
+        for_each([&](const T& value)
+        {
+            if(result)
+                result = f(std::move(*result), value);
+            else
+                result = value;
+        });
+        return result ? std::move(*result) : m_exemplar;
+    }
+
+    template<typename F>
+    void combine_each(F f) const
+    {
+        for_each(f);
+    }
+
+    void clear()
+    {
+        for(unsigned int i = 0; i < m_workers; ++i)
+            m_slots[i].value.reset();
+        m_external.clear();
+        // Invalidates every thread's cached external slot.
+        m_id = next_id();
+    }
+
+private:
+    struct alignas(64) slot
+    {
+        std::optional<T> value;
+    };
+
+    slot& external()
+    {
+        if(t_cache.id == m_id)
+            return *t_cache.found;
+
+        std::scoped_lock lock(m_mutex);
+        const auto self = std::this_thread::get_id();
+        slot* found = nullptr;
+        for(auto& e : m_external)
+            if(e.first == self)
+                found = e.second.get();
+        if(!found)
+        {
+            m_external.emplace_back(self, std::make_unique<slot>());
+            found = m_external.back().second.get();
+        }
+        t_cache = { m_id, found };
+        return *found;
+    }
+
+    static unsigned long next_id() noexcept
+    {
+        static std::atomic<unsigned long> id = 0;
+        return ++id;
+    }
+
+    const void* m_pool;
+    int (*m_worker)(const void*);
+    const unsigned int m_workers;
+    std::unique_ptr<slot[]> m_slots;
+    T m_exemplar;
+    unsigned long m_id;
+
+    std::mutex m_mutex;
+    std::vector<std::pair<std::thread::id, std::unique_ptr<slot>>> m_external;
+
+    struct cache
+    {
+        unsigned long id;
+        slot* found;
+    };
+    inline static thread_local cache t_cache = { 0, nullptr };
+};
+
+/*
+ * enumerable_thread_specific without the enumeration.
+ */
+template<typename T>
+class combinable
+{
+public:
+    template<typename Pool>
+    explicit combinable(const Pool& pool, T exemplar = T())
+    : m_values(pool, std::move(exemplar))
+    {
+    }
+
+    T& local()
+    {
+        return m_values.local();
+    }
+
+    template<typename F>
+    T combine(F f) const
+    {
+        return m_values.combine(f);
+    }
+
+    template<typename F>
+    void combine_each(F f) const
+    {
+        m_values.combine_each(f);
+    }
+
+    void clear()
+    {
+        m_values.clear();
+    }
+
+private:
+    enumerable_thread_specific<T> m_values;
+};
@@ -0,0 +1,227 @@
+/*
+ * ------------------------------------------------------------------------
+ * Worker threads of a pool that grows and shrinks with its load.
+ *
+ * Workers [0, min) live as long as the pool. Workers [min, max) are started
+ * by a supervisor thread, never by a submitter, whenever the queues fall
+ * behind: more than max_depth tasks queued per running worker, or a queue
+ * wait estimated from Little's law (queued tasks over the rate at which
+ * they were taken in the last interval) above max_wait. At most one
+ * worker is added per interval. An extra worker which has found nothing to
+ * do for idle_timeout exits on its own, the supervisor joins it and may
+ * reuse its slot later.
+ *
+ * With max_threads left at 0 the pool is fixed: the minimum is started up
+ * front and there is no supervisor at all.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <system_error>
+#include <condition_variable>
+
+struct worker_scaling
+{
+    // Upper bound of the worker count, 0 keeps it at the minimum.
+    unsigned int max_threads = 0;
+    // Queued tasks per running worker above which one is added.
+    unsigned int max_depth = 16;
+    // Estimated queue wait above which one is added.
+    std::chrono::microseconds max_wait = std::chrono::milliseconds(1);
+    // Idle time after which an extra worker exits.
+    std::chrono::milliseconds idle_timeout = std::chrono::seconds(5);
+    // How often the supervisor samples the load.
+    std::chrono::milliseconds interval = std::chrono::milliseconds(1);
+};
+
+/*
+ * What a pool reports to the supervisor: tasks waiting right now and the
+ * running total of tasks taken out of its queues.
+ */
+struct worker_load
+{
+    std::uint64_t queued = 0;
+    std::uint64_t dequeued = 0;
+};
+
+class worker_set
+{
+public:
+    worker_set(unsigned int threads, const worker_scaling& scaling)
+    :
+      m_min(threads),
+      m_max(scaling.max_threads ? scaling.max_threads : threads),
+      m_scaling(scaling),
+      m_slots(std::make_unique<slot[]>(m_max))
+    {
+        if(m_max < m_min || (elastic() && !scaling.interval.count()))
+            throw std::invalid_argument("Invalid worker scaling!");
+    }
+
+    worker_set(const worker_set&) = delete;
+    worker_set& operator=(const worker_set&) = delete;
+
+    ~worker_set()
+    {
+        join();
+    }
+
+    /*
+     * Starts the permanent workers, each running run(index), and the
+     * supervisor, which calls load() once per interval.
+     */
+    template<typename Run, typename Load>
+    void start(Run&& run, Load&& load)
+    {
+        m_run = std::forward<Run>(run);
+        for(unsigned int i = 0; i < m_min; ++i)
+            spawn(i);
+        if(elastic())
+            m_supervisor = std::thread([this, load = std::forward<Load>(load)]() mutable { supervise(load); });
+    }
+
+    /*
+     * Stops the supervisor and waits for every worker, which the pool must
+     * have told to finish.
+     */
+    void join()
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_stopping = true;
+        }
+        m_stop.notify_all();
+        if(m_supervisor.joinable())
+            m_supervisor.join();
+        for(unsigned int i = 0; i < m_max; ++i)
+            if(m_slots[i].thread.joinable())
+                m_slots[i].thread.join();
+    }
+
+    bool elastic() const noexcept
+    {
+        return m_max > m_min;
+    }
+
+    unsigned int min() const noexcept
+    {
+        return m_min;
+    }
+
+    unsigned int max() const noexcept
+    {
+        return m_max;
+    }
+
+    unsigned int running() const noexcept
+    {
+        return m_running.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Whether worker i may exit once idle for idle_timeout().
+     */
+    bool retirable(unsigned int i) const noexcept
+    {
+        return i >= m_min;
+    }
+
+    std::chrono::milliseconds idle_timeout() const noexcept
+    {
+        return m_scaling.idle_timeout;
+    }
+
+private:
+    struct alignas(64) slot
+    {
+        std::thread thread;
+        std::atomic_bool exited = false;
+    };
+
+    void spawn(unsigned int i)
+    {
+        auto& s = m_slots[i];
+        s.exited.store(false, std::memory_order_relaxed);
+        m_running.fetch_add(1, std::memory_order_relaxed);
+        try
+        {
+            s.thread = std::thread([this, i]()
+            {
+                m_run(i);
+                m_running.fetch_sub(1, std::memory_order_relaxed);
+                m_slots[i].exited.store(true, std::memory_order_release);
+            });
+        }
+        catch(...)
+        {
+            m_running.fetch_sub(1, std::memory_order_relaxed);
+            throw;
+        }
+    }
+
+    template<typename Load>
+    void supervise(Load& load)
+    {
+        const auto interval_us = std::chrono::duration_cast<std::chrono::microseconds>(m_scaling.interval).count();
+        auto last = load();
+
+        std::unique_lock lock(m_mutex);
+        while(!m_stop.wait_for(lock, m_scaling.interval, [this]() { return m_stopping; }))
+        {
+            // Join whoever retired, their slots are free again.
+            unsigned int free = m_max;
+            for(unsigned int i = m_max; i-- > m_min; )
+            {
+                auto& s = m_slots[i];
+                if(s.thread.joinable() && s.exited.load(std::memory_order_acquire))
+                    s.thread.join();
+                if(!s.thread.joinable())
+                    free = i;
+            }
+
+            const auto now = load();
+            const auto taken = now.dequeued - last.dequeued;
+            last = now;
+            if(free == m_max || !now.queued)
+                continue;
+
+            const auto running = std::max(1u, m_running.load(std::memory_order_relaxed));
+            const bool deep = now.queued > std::uint64_t(m_scaling.max_depth) * running;
+            const bool slow = !taken || now.queued * interval_us / taken > static_cast<std::uint64_t>(m_scaling.max_wait.count());
+            if(!deep && !slow)
+                continue;
+
+            try
+            {
+                spawn(free);
+            }
+            catch(const std::system_error&)
+            {
+                // Out of threads for now, try again next interval.
+            }
+        }
+    }
+
+    const unsigned int m_min;
+    const unsigned int m_max;
+    const worker_scaling m_scaling;
+    std::unique_ptr<slot[]> m_slots;
+    std::function<void(unsigned int)> m_run;
+
+    std::atomic_uint m_running = 0;
+
+    std::thread m_supervisor;
+    std::mutex m_mutex;
+    std::condition_variable m_stop;
+    bool m_stopping = false;
+};
@@ -1,4 +1,14 @@
 #include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <sys/resource.h>
+#include <boost/program_options.hpp>
 
 #include "threat_pool.h"
 
@@ -11,9 +21,47 @@
  * https://vorbrodt.blog/2019/02/27/advanced-thread-pool/
  *
  * */
-static std::atomic<int> nr_primes = 0;
 
-void isPrime(unsigned int nr)
+namespace po = boost::program_options;
+
+using driver_clock = std::chrono::steady_clock;
+
+struct config
+{
+    std::string pool;
+    std::string queue;
+    std::string semaphore;
+    std::string wait;
+    std::string workload;
+    std::string affinity;
+    std::string submit;
+    unsigned int threads;
+    unsigned int max_threads;
+    unsigned int queues;
+    unsigned int producers;
+    unsigned int capacity;
+    std::string pages;
+    bool prefault;
+    unsigned long tasks;
+    unsigned int phases;
+    unsigned int sleep_us;
+    unsigned int memory_mb;
+};
+
+// One counter per worker instead of a shared atomic, summed at the end.
+static std::unique_ptr<combinable<int>> nr_primes;
+
+static std::vector<std::int64_t> latencies;
+static std::vector<std::uint64_t> memory;
+static thread_local volatile std::uint64_t sink;
+
+static std::int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                driver_clock::now().time_since_epoch()).count();
+}
+
+bool isPrime(unsigned int nr)
 {
     bool result = true;
     for (unsigned int i = 2; i <= nr / 2; i++)
@@ -24,42 +72,408 @@ void isPrime(unsigned int nr)
             break;
         }
     }
-    if (result)
+    return result;
+}
+
+static void spin_for(std::chrono::nanoseconds duration)
+{
+    auto until = driver_clock::now() + duration;
+    while(driver_clock::now() < until)
+        ;
+}
+
+/*
+ * Workloads. Each task receives its index and the time it was submitted
+ * and records its submit-to-completion latency when done.
+ */
+static void tiny_task(unsigned long id, std::int64_t submitted)
+{
+    // Odd numbers 3..99, as the original benchmark.
+    if(isPrime(static_cast<unsigned int>(3 + 2 * (id % 49))))
+        ++nr_primes->local();
+    latencies[id] = now_ns() - submitted;
+}
+
+static void memory_task(unsigned long id, std::int64_t submitted)
+{
+    // Dependent random reads, every one a likely cache miss.
+    std::uint64_t index = id % memory.size();
+    for(int i = 0; i < 256; ++i)
+        index = memory[index];
+    sink = index;
+    latencies[id] = now_ns() - submitted;
+}
+
+static void mixed_task(unsigned long id, std::int64_t submitted)
+{
+    // 90% ~1us, 9% ~50us, 1% ~1ms.
+    const auto bucket = (id * 2654435761ul) % 100;
+    if(bucket == 0)
+        spin_for(std::chrono::milliseconds(1));
+    else if(bucket < 10)
+        spin_for(std::chrono::microseconds(50));
+    else
+        spin_for(std::chrono::microseconds(1));
+    latencies[id] = now_ns() - submitted;
+}
+
+static unsigned int sleep_us;
+
+static void sleep_task(unsigned long id, std::int64_t submitted)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+    latencies[id] = now_ns() - submitted;
+}
+
+#ifdef __cpp_impl_coroutine
+/*
+ * One task as a coroutine, resumed on a worker by schedule().
+ */
+template<typename Pool>
+pool_task<void> coro_task(Pool& pool, void (*task)(unsigned long, std::int64_t), unsigned long id)
+{
+    const auto submitted = now_ns();
+    co_await pool.schedule();
+    task(id, submitted);
+}
+
+static const unsigned long coro_batch = 1024;
+#endif
+
+template<typename Pool>
+int run(const config& cfg, Pool& pool)
+{
+    nr_primes = std::make_unique<combinable<int>>(pool);
+
+    void (*task)(unsigned long, std::int64_t) = tiny_task;
+    if(cfg.workload == "memory")
+        task = memory_task;
+    else if(cfg.workload == "mixed")
+        task = mixed_task;
+    else if(cfg.workload == "sleep")
+        task = sleep_task;
+
+    if(cfg.submit == "range")
+    {
+        // One parallel_for over all ids, latencies count from its start.
+        const auto submitted = now_ns();
+        parallel_for(pool, 0ul, cfg.tasks, [task, submitted](unsigned long id) { task(id, submitted); });
+        std::cout << "parallel_for ended. Stopping pool..." << std::endl;
+        return 0;
+    }
+
+    if(cfg.phases > 1)
+    {
+        // Batch phases on one pool: this thread submits a slice of the ids
+        // and waits for it with wait_idle() before the next one.
+        for(unsigned int phase = 0; phase < cfg.phases; ++phase)
+        {
+            const auto last = cfg.tasks * (phase + 1) / cfg.phases;
+            for(unsigned long id = cfg.tasks * phase / cfg.phases; id < last; ++id)
+                pool.enqueue_work(task, id, now_ns());
+            pool.wait_idle();
+        }
+        std::cout << "Phases ended. Stopping pool..." << std::endl;
+        return 0;
+    }
+
+    std::vector<std::thread> producers;
+#ifdef __cpp_impl_coroutine
+    if(cfg.submit == "coro")
+    {
+        // Every producer awaits its ids in when_all() batches of coro_batch.
+        for(unsigned int p = 0; p < cfg.producers; ++p)
+            producers.emplace_back([&cfg, &pool, task, p]()
+            {
+                std::vector<pool_task<void>> batch;
+                for(unsigned long id = p; id < cfg.tasks; id += cfg.producers)
+                {
+                    batch.push_back(coro_task(pool, task, id));
+                    if(batch.size() == coro_batch)
+                        sync_wait(when_all(std::exchange(batch, {})));
+                }
+                sync_wait(when_all(std::move(batch)));
+            });
+    }
+    else
+#endif
+    for(unsigned int p = 0; p < cfg.producers; ++p)
+        producers.emplace_back([&cfg, &pool, task, p]()
+        {
+            for(unsigned long id = p; id < cfg.tasks; id += cfg.producers)
+                pool.enqueue_work(task, id, now_ns());
+        });
+
+    for(auto& producer : producers)
+        producer.join();
+
+    std::cout << "Enqueue ended. Stopping pool..." << std::endl;
+    return 0;
+}
+
+template<typename Q>
+int run_pool(const config& cfg)
+{
+    worker_scaling scaling;
+    scaling.max_threads = cfg.max_threads;
+
+    if(cfg.pool == "simple")
     {
-        nr_primes++;
+        simple_thread_pool<Q> pool(cfg.threads, scaling);
+        return run(cfg, pool);
     }
-//    return result;
+
+    auto affinity = affinity_policy::none;
+    if(cfg.affinity == "pinned")
+        affinity = affinity_policy::pinned;
+    else if(cfg.affinity == "numa")
+        affinity = affinity_policy::numa;
+
+    thread_pool<Q> pool(cfg.threads, cfg.queues, cfg.pool == "stealing", affinity, 1, scaling);
+    return run(cfg, pool);
 }
+
+/*
+ * The bounded queues take their capacity at run time, but thread_pool
+ * default constructs its queues, so these read it from here.
+ */
+static unsigned long queue_capacity;
+static ring_options queue_memory;
+
+template<typename T, typename S>
+struct sized_fixed_blocking_queue : fixed_blocking_queue<T, S>
+{
+    sized_fixed_blocking_queue() : fixed_blocking_queue<T, S>(queue_capacity) {}
+};
+
+template<typename Q, typename S>
+struct sized_ring_queue : atomic_blocking_queue<thread_pool_proc, Q, S>
+{
+    sized_ring_queue() : atomic_blocking_queue<thread_pool_proc, Q, S>(queue_capacity, queue_memory) {}
+};
+
+template<typename S, typename W>
+struct sized_lockfree_queue : atomic_blocking_queue<thread_pool_proc, LockFreeQueue<thread_pool_proc, 4096, W>, S>
+{
+    sized_lockfree_queue() : atomic_blocking_queue<thread_pool_proc, LockFreeQueue<thread_pool_proc, 4096, W>, S>(64, 64, queue_capacity, queue_memory) {}
+};
+
+template<typename S, typename W>
+int run_queue(const config& cfg)
+{
+    // Unbounded, capacity does not apply.
+    if(cfg.queue == "segmented")
+        return run_pool<segmented_queue<thread_pool_proc, S, 256, W>>(cfg);
+    if(cfg.queue == "fixed")
+        return run_pool<sized_fixed_blocking_queue<thread_pool_proc, S>>(cfg);
+    if(cfg.queue == "atomic")
+        return run_pool<sized_ring_queue<atomic_blocking_queue_impl<thread_pool_proc, 4096, W>, S>>(cfg);
+    if(cfg.queue == "mpmc")
+        return run_pool<sized_ring_queue<mpmc_ring<thread_pool_proc, 4096, W>, S>>(cfg);
+    return run_pool<sized_lockfree_queue<S, W>>(cfg);
+}
+
+/*
+ * W for the queues and the fast and futex semaphores alike.
+ */
+template<typename W>
+int run_wait(const config& cfg)
+{
+    if(cfg.semaphore == "semaphore")
+        return run_queue<semaphore, W>(cfg);
+#ifdef __linux__
+    if(cfg.semaphore == "futex")
+        return run_queue<basic_futex_semaphore<W>, W>(cfg);
+#endif
+    return run_queue<basic_fast_semaphore<W>, W>(cfg);
+}
+
+int dispatch(const config& cfg)
+{
+    if(cfg.queue == "blocking")
+        return run_pool<blocking_queue<thread_pool_proc>>(cfg);
+
+    if(cfg.wait == "spin")
+        return run_wait<busy_spin_wait>(cfg);
+    if(cfg.wait == "backoff")
+        return run_wait<backoff_wait>(cfg);
+    if(cfg.wait == "yield")
+        return run_wait<yield_wait>(cfg);
+    if(cfg.wait == "park")
+        return run_wait<spin_then_park_wait<0>>(cfg);
+
+    // The queues yield, the semaphores spin a while and then park.
+    if(cfg.semaphore == "semaphore")
+        return run_queue<semaphore, yield_wait>(cfg);
+#ifdef __linux__
+    if(cfg.semaphore == "futex")
+        return run_queue<futex_semaphore, yield_wait>(cfg);
+#endif
+    return run_queue<fast_semaphore, yield_wait>(cfg);
+}
+
+static double cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+template<typename C, typename V>
+static bool one_of(const C& c, const V& v)
+{
+    return std::find(c.begin(), c.end(), v) != c.end();
+}
+
 int main(int argc, char* argv[])
 {
-    auto start = std::chrono::steady_clock::now();
+    config cfg;
+
+    po::options_description desc("Thread pool benchmark options");
+    desc.add_options()
+        ("help,h", "print this help")
+        ("pool", po::value<std::string>(&cfg.pool)->default_value("thread"),
+         "simple, thread or stealing (thread_pool with work stealing)")
+        ("queue", po::value<std::string>(&cfg.queue)->default_value("lockfree"),
+         "blocking, segmented, fixed, atomic, mpmc or lockfree")
+        ("semaphore", po::value<std::string>(&cfg.semaphore)->default_value("fast"),
+         "semaphore, fast or futex; ignored by the blocking queue")
+        ("wait", po::value<std::string>(&cfg.wait)->default_value("default"),
+         "default, spin, backoff, yield or park (see wait_strategy.h); ignored by the blocking queue")
+        ("capacity", po::value<unsigned int>(&cfg.capacity)->default_value(4),
+         "per queue capacity, rounded up to a power of two by the rings; ignored by the blocking and segmented queues")
+        ("pages", po::value<std::string>(&cfg.pages)->default_value("normal"),
+         "normal, transparent or huge pages for rings of at least 2 MiB")
+        ("prefault", po::bool_switch(&cfg.prefault),
+         "touch every page of the rings up front")
+        ("threads,t", po::value<unsigned int>(&cfg.threads)->default_value(2),
+         "worker threads")
+        ("max-threads", po::value<unsigned int>(&cfg.max_threads)->default_value(0),
+         "grow up to this many workers under load, 0 keeps --threads fixed")
+        ("queues,q", po::value<unsigned int>(&cfg.queues)->default_value(2),
+         "queues, thread_pool only")
+        ("affinity", po::value<std::string>(&cfg.affinity)->default_value("none"),
+         "none, pinned or numa (node local queues and submission), thread_pool only")
+        ("producers,p", po::value<unsigned int>(&cfg.producers)->default_value(1),
+         "threads submitting tasks")
+        ("tasks,n", po::value<unsigned long>(&cfg.tasks)->default_value(4900000),
+         "tasks to submit")
+        ("phases", po::value<unsigned int>(&cfg.phases)->default_value(1),
+         "submit the tasks in this many batches from the main thread, each awaited with wait_idle(); each only, ignores --producers")
+        ("submit", po::value<std::string>(&cfg.submit)->default_value("each"),
+#ifdef __cpp_impl_coroutine
+         "each (one enqueue_work per task), range (a single parallel_for) or coro (coroutines awaited in batches)")
+#else
+         "each (one enqueue_work per task) or range (a single parallel_for)")
+#endif
+        ("workload,w", po::value<std::string>(&cfg.workload)->default_value("tiny"),
+         "tiny (isPrime), memory (random reads), mixed (1us/50us/1ms spins) or sleep")
+        ("sleep-us", po::value<unsigned int>(&cfg.sleep_us)->default_value(100),
+         "sleep per task of the sleep workload")
+        ("memory-mb", po::value<unsigned int>(&cfg.memory_mb)->default_value(64),
+         "buffer size of the memory workload");
 
-    unsigned int maxnr = 100000;
-    unsigned int th_count = 2;
-    unsigned int q_count = 2;
-    if (argc == 4)
+    po::variables_map vm;
+    try
     {
-        maxnr = static_cast<unsigned int>(atoi(argv[1]));
-        th_count = static_cast<unsigned int>(atoi(argv[2]));
-        q_count = static_cast<unsigned int>(atoi(argv[3]));
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
     }
+    catch(const po::error& e)
     {
-        thread_pool<
-                atomic_blocking_queue<
-                    std::function<void(void)>,
-                    LockFreeQueue<std::function<void(void)>,4>,fast_semaphore,4>> tp(th_count, q_count);
+        std::cerr << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
 
-        set_thr_id(0);
+    if(vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        return 0;
+    }
 
-        for (unsigned int j = 0; j < maxnr; j++)
-            for (unsigned int i = 3; i < 100; i++,i++)
-            {
-                tp.enqueue_work(isPrime, i);
-            }
-        std::cout << "Enqueue ended. Stopping pool..." << std::endl;
+    std::vector<std::string> submit_modes{"each", "range"};
+#ifdef __cpp_impl_coroutine
+    submit_modes.push_back("coro");
+#endif
+
+    if(!one_of(std::vector<std::string>{"simple", "thread", "stealing"}, cfg.pool) ||
+       !one_of(std::vector<std::string>{"blocking", "segmented", "fixed", "atomic", "mpmc", "lockfree"}, cfg.queue) ||
+       !one_of(std::vector<std::string>{"semaphore", "fast", "futex"}, cfg.semaphore) ||
+       !one_of(std::vector<std::string>{"default", "spin", "backoff", "yield", "park"}, cfg.wait) ||
+       !one_of(std::vector<std::string>{"normal", "transparent", "huge"}, cfg.pages) ||
+       !one_of(std::vector<std::string>{"tiny", "memory", "mixed", "sleep"}, cfg.workload) ||
+       !one_of(std::vector<std::string>{"none", "pinned", "numa"}, cfg.affinity) ||
+       !one_of(submit_modes, cfg.submit))
+    {
+        std::cerr << "Invalid option value." << std::endl << desc << std::endl;
+        return 1;
+    }
+
+    if(!cfg.producers || !cfg.tasks || !cfg.phases)
+    {
+        std::cerr << "producers, tasks and phases must be positive" << std::endl;
+        return 1;
+    }
+
+    if(cfg.phases > 1 && cfg.submit != "each")
+    {
+        std::cerr << "phases need --submit each" << std::endl;
+        return 1;
+    }
+
+    if(!cfg.capacity || cfg.capacity > (1u << 30))
+    {
+        std::cerr << "capacity must be between 1 and 2^30" << std::endl;
+        return 1;
+    }
+    queue_capacity = cfg.capacity;
+    if(cfg.pages == "transparent")
+        queue_memory.pages = ring_pages::transparent;
+    else if(cfg.pages == "huge")
+        queue_memory.pages = ring_pages::huge;
+    queue_memory.prefault = cfg.prefault;
+
+    latencies.assign(cfg.tasks, 0);
+    sleep_us = cfg.sleep_us;
+    if(cfg.workload == "memory")
+    {
+        memory.resize(std::max(1ul, cfg.memory_mb * 1024ul * 1024ul / sizeof(std::uint64_t)));
+        for(size_t i = 0; i < memory.size(); ++i)
+            memory[i] = (i * 2654435761ul + 12345) % memory.size();
+    }
+
+    auto cpu_start = cpu_seconds();
+    auto start = driver_clock::now();
+
+    try
+    {
+        if(auto result = dispatch(cfg))
+            return result;
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
-    std::cout<< "First " << maxnr << " primes: " << nr_primes << std::endl;
-    auto stop = std::chrono::steady_clock::now();
+
+    auto stop = driver_clock::now();
+    auto cpu = cpu_seconds() - cpu_start;
+    auto wall = std::chrono::duration<double>(stop - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [](double p)
+    {
+        return latencies[static_cast<size_t>(p * (latencies.size() - 1))] / 1000.0;
+    };
+
+    if(cfg.workload == "tiny")
+        std::cout << "Primes found: " << nr_primes->combine(std::plus<int>()) << std::endl;
     std::cout << "Duration: " << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() << "ms." << std::endl;
+    std::cout << "Throughput: " << static_cast<unsigned long>(cfg.tasks / wall) << " tasks/s" << std::endl;
+    std::cout << "Latency p50/p99/p99.9: "
+              << percentile(0.5) << " / " << percentile(0.99) << " / " << percentile(0.999) << " us" << std::endl;
+    std::cout << "CPU: " << cpu << "s, utilization " << 100.0 * cpu / (wall * std::max(1u, std::thread::hardware_concurrency()))
+              << "% of " << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
     return 0;
 }
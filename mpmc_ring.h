@@ -0,0 +1,215 @@
+/*
+ * ------------------------------------------------------------------------
+ * Bounded multi producer multi consumer ring with per-slot sequence
+ * numbers (D. Vyukov's design).
+ *
+ * Every cell carries a sequence number telling whose turn it is: pos for
+ * the producer of position pos, pos + 1 for its consumer, pos + m_size for
+ * the producer of the next lap. A thread claims a position on the shared
+ * index, waits for its own cell's turn only and hands the cell on with one
+ * release store. There is no ordering spin on a global completion index,
+ * so a producer or consumer descheduled in the middle of its copy holds up
+ * nobody but the thread one lap behind it on the very same cell.
+ *
+ * Plugs into atomic_blocking_queue as its Q, whose semaphores guarantee
+ * room for push() and an item for pop(). try_push()/try_pop() claim a
+ * position with a compare-exchange only once its cell is ready and can be
+ * used on their own, without the semaphores.
+ *
+ * The constructor writes every cell's sequence number, so the pages of the
+ * ring are placed by the constructing thread and there is no prefault().
+ * Q_SIZE is the default capacity, see ring_memory.h. W is how a thread
+ * waits for its cell's turn, see wait_strategy.h.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <iterator>
+#include "ring_memory.h"
+#include "wait_strategy.h"
+
+template<typename T,
+         unsigned long Q_SIZE = 4096ul,
+         typename W = yield_wait>
+class mpmc_ring
+{
+public:
+    explicit mpmc_ring(unsigned long capacity = Q_SIZE, const ring_options& options = ring_options())
+    :
+      m_size(ring_capacity(capacity)),
+      m_mask(m_size - 1),
+      m_memory(sizeof(cell) * m_size, options),
+      m_cells(static_cast<cell*>(m_memory.data()))
+    {
+        for(unsigned long i = 0; i < m_size; ++i)
+            new (&m_cells[i].seq) std::atomic<unsigned long> (i);
+    }
+
+    mpmc_ring(const mpmc_ring&) = delete;
+    mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+    ~mpmc_ring() noexcept
+    {
+        const auto tail = m_push.load(std::memory_order_acquire);
+        for(auto head = m_pop.load(std::memory_order_relaxed); head != tail; ++head)
+        {
+            auto& c = m_cells[head & m_mask];
+            if(c.seq.load(std::memory_order_acquire) == head + 1)
+                c.item()->~T();
+        }
+    }
+
+    unsigned long capacity() const noexcept
+    {
+        return m_size;
+    }
+
+    /*
+     * The caller guarantees there is room.
+     */
+    void push(T&& item) noexcept
+    {
+        const auto pos = m_push.fetch_add(1, std::memory_order_relaxed);
+        put(pos, std::move(item));
+    }
+
+    /*
+     * Claims one range for [first, last) with a single fetch_add. The
+     * caller guarantees there is room for all of it.
+     */
+    template<typename It>
+    void push_bulk(It first, It last) noexcept
+    {
+        const auto n = static_cast<unsigned long>(std::distance(first, last));
+        const auto pos = m_push.fetch_add(n, std::memory_order_relaxed);
+        for(unsigned long i = 0; i < n; ++i, ++first)
+            put(pos + i, std::move(*first));
+    }
+
+    /*
+     * The caller guarantees there is an item.
+     */
+    void pop(T& item) noexcept
+    {
+        const auto pos = m_pop.fetch_add(1, std::memory_order_relaxed);
+        take(pos, item);
+    }
+
+    /*
+     * Takes exactly n items with a single fetch_add. The caller guarantees
+     * that many are available.
+     */
+    template<typename It>
+    void pop_bulk(It out, unsigned int n) noexcept
+    {
+        const auto pos = m_pop.fetch_add(n, std::memory_order_relaxed);
+        for(unsigned long i = 0; i < n; ++i, ++out)
+            take(pos + i, *out);
+    }
+
+    /*
+     * False, with item untouched, if the ring is full.
+     */
+    bool try_push(T&& item) noexcept
+    {
+        auto pos = m_push.load(std::memory_order_relaxed);
+        while(true)
+        {
+            auto& c = m_cells[pos & m_mask];
+            const auto seq = c.seq.load(std::memory_order_acquire);
+            const auto diff = static_cast<long>(seq - pos);
+            if(!diff)
+            {
+                if(m_push.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    new (c.item()) T (std::move(item));
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+                return false;
+            else
+                pos = m_push.load(std::memory_order_relaxed);
+        }
+    }
+
+    /*
+     * False if the ring is empty.
+     */
+    bool try_pop(T& item) noexcept
+    {
+        auto pos = m_pop.load(std::memory_order_relaxed);
+        while(true)
+        {
+            auto& c = m_cells[pos & m_mask];
+            const auto seq = c.seq.load(std::memory_order_acquire);
+            const auto diff = static_cast<long>(seq - (pos + 1));
+            if(!diff)
+            {
+                if(m_pop.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    item = std::move(*c.item());
+                    c.item()->~T();
+                    c.seq.store(pos + m_size, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+                return false;
+            else
+                pos = m_pop.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<unsigned long> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T* item() noexcept
+        {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+
+    /*
+     * Only the consumer one lap behind on this cell can still be in it.
+     */
+    void put(unsigned long pos, T&& item) noexcept
+    {
+        auto& c = m_cells[pos & m_mask];
+        W w;
+        while(c.seq.load(std::memory_order_acquire) != pos)
+            w.pause();
+        new (c.item()) T (std::move(item));
+        c.seq.store(pos + 1, std::memory_order_release);
+    }
+
+    /*
+     * Only the producer of this very position can still be in the cell.
+     */
+    template<typename U>
+    void take(unsigned long pos, U& item) noexcept
+    {
+        auto& c = m_cells[pos & m_mask];
+        W w;
+        while(c.seq.load(std::memory_order_acquire) != pos + 1)
+            w.pause();
+        item = std::move(*c.item());
+        c.item()->~T();
+        c.seq.store(pos + m_size, std::memory_order_release);
+    }
+
+    alignas(64) std::atomic<unsigned long> m_push = 0;
+    alignas(64) std::atomic<unsigned long> m_pop = 0;
+    alignas(64) const unsigned long m_size;
+    const unsigned long m_mask;
+    ring_memory m_memory;
+    cell* m_cells;
+};
@@ -0,0 +1,358 @@
+/*
+ * ------------------------------------------------------------------------
+ * Range algorithms on top of the thread pools.
+ *
+ * parallel_for splits [begin, end) lazily. The calling thread starts out
+ * owning the whole range and helper tasks are submitted to the pool, one
+ * per worker. Every participant eats its own range from the front, grain
+ * elements at a time; a participant without work takes the back half of
+ * whichever range has the most left. So the range is only ever split when
+ * somebody is actually idle, and a helper which starts late (or never,
+ * because the pool is busy) costs nothing.
+ *
+ * The caller blocks until every element has run, taking part in the work
+ * meanwhile, so calling parallel_for from inside a task can not deadlock.
+ * The first exception thrown by the body cancels what is left and is
+ * rethrown to the caller.
+ *
+ * parallel_reduce folds into one combinable slot per worker and combines
+ * them once at the end, parallel_scan does the usual two passes over a
+ * few blocks per participant.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <iterator>
+#include <exception>
+#include <algorithm>
+#include <type_traits>
+#include <condition_variable>
+#include "combinable.h"
+
+/*
+ * One participant's share of the range. The owner claims from the front,
+ * thieves split off the back, both under the spin lock; begin and end are
+ * atomics only so thieves may peek at the size without it.
+ */
+struct alignas(64) parallel_range
+{
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+    std::atomic<std::size_t> begin = 0;
+    std::atomic<std::size_t> end = 0;
+
+    std::size_t size() const noexcept
+    {
+        const auto b = begin.load(std::memory_order_relaxed);
+        const auto e = end.load(std::memory_order_relaxed);
+        return e > b ? e - b : 0;
+    }
+
+    void acquire() noexcept
+    {
+        while(lock.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+
+    void release() noexcept
+    {
+        lock.clear(std::memory_order_release);
+    }
+
+    bool claim(std::size_t grain, std::size_t& first, std::size_t& last) noexcept
+    {
+        acquire();
+        first = begin.load(std::memory_order_relaxed);
+        last = std::min(first + grain, end.load(std::memory_order_relaxed));
+        if(first < last)
+            begin.store(last, std::memory_order_relaxed);
+        release();
+        return first < last;
+    }
+
+    bool split(std::size_t& first, std::size_t& last) noexcept
+    {
+        acquire();
+        const auto b = begin.load(std::memory_order_relaxed);
+        last = end.load(std::memory_order_relaxed);
+        first = last - (last - b + 1) / 2;
+        if(first < last)
+            end.store(first, std::memory_order_relaxed);
+        release();
+        return first < last;
+    }
+
+    void assign(std::size_t first, std::size_t last) noexcept
+    {
+        acquire();
+        begin.store(first, std::memory_order_relaxed);
+        end.store(last, std::memory_order_relaxed);
+        release();
+    }
+};
+
+template<typename Body>
+class parallel_for_state
+{
+public:
+    parallel_for_state(std::size_t size, unsigned int participants, std::size_t grain, Body body)
+    :
+      m_ranges(std::make_unique<parallel_range[]>(participants)),
+      m_count(participants),
+      m_size(size),
+      m_grain(grain),
+      m_body(std::move(body))
+    {
+        m_ranges[0].assign(0, size);
+    }
+
+    /*
+     * Runs on the caller and on every helper. Participants after the
+     * first start empty and steal right away.
+     */
+    void participate()
+    {
+        const auto self = m_next.fetch_add(1, std::memory_order_relaxed);
+        if(self >= m_count)
+            return;
+
+        auto& own = m_ranges[self];
+        std::size_t first, last;
+        while(true)
+        {
+            if(!own.claim(m_grain, first, last))
+            {
+                if(!steal(self, first, last))
+                    return;
+                own.assign(first, last);
+                continue;
+            }
+            run(first, last);
+        }
+    }
+
+    void wait()
+    {
+        {
+            std::unique_lock lock(m_mutex);
+            m_finished.wait(lock, [this]() { return m_completed.load(std::memory_order_acquire) == m_size; });
+        }
+        if(m_error)
+            std::rethrow_exception(m_error);
+    }
+
+private:
+    void run(std::size_t first, std::size_t last)
+    {
+        try
+        {
+            m_body(first, last);
+        }
+        catch(...)
+        {
+            cancel(std::current_exception());
+        }
+        completed(last - first);
+    }
+
+    bool steal(unsigned int self, std::size_t& first, std::size_t& last) noexcept
+    {
+        while(true)
+        {
+            unsigned int victim = m_count;
+            std::size_t most = 0;
+            for(unsigned int i = 0; i < m_count; ++i)
+            {
+                const auto size = m_ranges[i].size();
+                if(i != self && size > most)
+                {
+                    most = size;
+                    victim = i;
+                }
+            }
+            if(victim == m_count)
+                return false;
+            if(m_ranges[victim].split(first, last))
+                return true;
+        }
+    }
+
+    void cancel(std::exception_ptr error) noexcept
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+            if(!m_error)
+                m_error = error;
+        }
+        // Whatever nobody claimed yet will never run, account for it here.
+        for(unsigned int i = 0; i < m_count; ++i)
+        {
+            auto& range = m_ranges[i];
+            range.acquire();
+            const auto left = range.size();
+            range.begin.store(range.end.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            range.release();
+            if(left)
+                completed(left);
+        }
+    }
+
+    void completed(std::size_t n) noexcept
+    {
+        if(m_completed.fetch_add(n, std::memory_order_acq_rel) + n == m_size)
+        {
+            std::scoped_lock lock(m_mutex);
+            m_finished.notify_all();
+        }
+    }
+
+    std::unique_ptr<parallel_range[]> m_ranges;
+    const unsigned int m_count;
+    const std::size_t m_size;
+    const std::size_t m_grain;
+    Body m_body;
+
+    alignas(64) std::atomic_uint m_next = 0;
+    alignas(64) std::atomic<std::size_t> m_completed = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_finished;
+    std::exception_ptr m_error;
+};
+
+/*
+ * Calls body(first, last) for disjoint chunks covering [begin, end). A
+ * grain of 0 picks one giving every participant about 64 claims when
+ * nobody steals.
+ */
+template<typename Pool, typename Index, typename Body>
+void parallel_for_range(Pool& pool, Index begin, Index end, Body&& body, std::size_t grain = 0)
+{
+    static_assert(std::is_integral<Index>::value, "parallel_for needs an integral index!");
+
+    if(!(begin < end))
+        return;
+
+    const auto size = static_cast<std::size_t>(end - begin);
+    const auto threads = pool.threads();
+    if(!grain)
+        grain = std::max<std::size_t>(1, size / ((threads + 1) * 64ul));
+
+    const auto chunks = (size + grain - 1) / grain;
+    const auto helpers = static_cast<unsigned int>(std::min<std::size_t>(threads, chunks - 1));
+
+    auto chunk = [&body, begin](std::size_t first, std::size_t last)
+    {
+        body(static_cast<Index>(begin + first), static_cast<Index>(begin + last));
+    };
+    using State = parallel_for_state<decltype(chunk)>;
+    auto state = std::make_shared<State>(size, helpers + 1, grain, chunk);
+
+    for(unsigned int i = 0; i < helpers; ++i)
+        pool.enqueue_work([state]() { state->participate(); });
+
+    state->participate();
+    state->wait();
+}
+
+/*
+ * Calls body(i) for every i in [begin, end).
+ */
+template<typename Pool, typename Index, typename Body>
+void parallel_for(Pool& pool, Index begin, Index end, Body&& body, std::size_t grain = 0)
+{
+    parallel_for_range(pool, begin, end, [&body](Index first, Index last)
+    {
+        for(auto i = first; i < last; ++i)
+            body(i);
+    }, grain);
+}
+
+/*
+ * Calls body(*it) for every it in [first, last), random access only.
+ */
+template<typename Pool, typename It, typename Body>
+void parallel_for_each(Pool& pool, It first, It last, Body&& body, std::size_t grain = 0)
+{
+    static_assert(std::is_base_of<std::random_access_iterator_tag,
+                                  typename std::iterator_traits<It>::iterator_category>::value,
+                  "parallel_for_each needs random access iterators!");
+
+    using Index = typename std::iterator_traits<It>::difference_type;
+    parallel_for(pool, Index(0), Index(last - first), [first, &body](Index i) { body(first[i]); }, grain);
+}
+
+/*
+ * Folds map(i) for every i in [begin, end) with reduce, starting from
+ * identity. Elements are grouped per worker, not in index order, so reduce
+ * has to be associative and commutative.
+ */
+template<typename Pool, typename Index, typename T, typename Map, typename Reduce>
+T parallel_reduce(Pool& pool, Index begin, Index end, T identity, Map&& map, Reduce&& reduce, std::size_t grain = 0)
+{
+    combinable<T> partial(pool, identity);
+
+    parallel_for_range(pool, begin, end, [&](Index first, Index last)
+    {
+        auto& local = partial.local();
+        for(auto i = first; i < last; ++i)
+            local = reduce(std::move(local), map(i));
+    }, grain);
+
+    return partial.combine(reduce);
+}
+
+/*
+ * Inclusive scan of [first, last) into out with the associative op, out
+ * may equal first. Pass one reduces every block, the block totals are
+ * scanned serially, pass two rescans every block from its offset.
+ */
+template<typename Pool, typename It, typename Out, typename T, typename Op>
+void parallel_scan(Pool& pool, It first, It last, Out out, T identity, Op&& op)
+{
+    static_assert(std::is_base_of<std::random_access_iterator_tag,
+                                  typename std::iterator_traits<It>::iterator_category>::value,
+                  "parallel_scan needs random access iterators!");
+
+    const auto size = static_cast<std::size_t>(last - first);
+    if(!size)
+        return;
+
+    const auto blocks = std::min<std::size_t>(size, (pool.threads() + 1) * 4ul);
+    const auto block = (size + blocks - 1) / blocks;
+
+    std::vector<T> totals(blocks, identity);
+    parallel_for(pool, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        const auto end = std::min(size, (b + 1) * block);
+        T sum = identity;
+        for(auto i = b * block; i < end; ++i)
+            sum = op(std::move(sum), first[i]);
+        totals[b] = std::move(sum);
+    }, 1);
+
+    T carry = identity;
+    for(auto& total : totals)
+    {
+        auto next = op(carry, total);
+        total = std::move(carry);
+        carry = std::move(next);
+    }
+
+    parallel_for(pool, std::size_t(0), blocks, [&](std::size_t b)
+    {
+        const auto end = std::min(size, (b + 1) * block);
+        T sum = totals[b];
+        for(auto i = b * block; i < end; ++i)
+        {
+            sum = op(std::move(sum), first[i]);
+            out[i] = sum;
+        }
+    }, 1);
+}
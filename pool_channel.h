@@ -0,0 +1,132 @@
+/*
+ * ------------------------------------------------------------------------
+ * Dedicated producer to worker channel of a pool.
+ *
+ * Opening a channel submits one drain task, which then keeps the worker
+ * that picked it up for itself until the channel is closed. The producer
+ * hands tasks over through an atomic_blocking_queue on an spsc_ring, so a
+ * push is a semaphore post and a store to a line nobody else writes, and
+ * the worker takes whatever has arrived in batches of up to B. Tasks run
+ * in the order they were pushed.
+ *
+ * Exactly one thread may push into a channel. close() (or the destructor)
+ * lets the worker finish what is queued and go back to the pool; a channel
+ * must be closed before its pool is destroyed, or the pool waits for the
+ * drain task forever. The drain task is lent a worker rather than queued
+ * as work, so wait_idle() neither waits for the channel nor runs the drain
+ * task on its caller. An elastic pool (see elastic.h) makes up for the
+ * worker it lends out.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <memory>
+#include <tuple>
+#include <utility>
+#include "queue.h"
+#include "semaphore.h"
+#include "spsc_ring.h"
+#include "unique_task.h"
+
+template<typename S = fast_semaphore,
+         unsigned long Q_SIZE = 1024ul>
+class pool_channel
+{
+public:
+    using task = unique_task<void(void)>;
+
+    template<typename Pool>
+    explicit pool_channel(Pool& pool)
+    : m_queue(std::make_shared<queue>())
+    {
+        pool.lend_worker([queue = m_queue]() { drain(*queue); });
+    }
+
+    pool_channel(const pool_channel&) = delete;
+    pool_channel& operator=(const pool_channel&) = delete;
+
+    ~pool_channel()
+    {
+        close();
+    }
+
+    /*
+     * Blocks while the channel is full.
+     */
+    template<typename F, typename... Args>
+    void push(F&& f, Args&&... args)
+    {
+        m_queue->push(bind(std::forward<F>(f), std::forward<Args>(args)...));
+    }
+
+    /*
+     * False, with nothing queued, if the channel is full.
+     */
+    template<typename F, typename... Args>
+    bool try_push(F&& f, Args&&... args)
+    {
+        return m_queue->try_push(bind(std::forward<F>(f), std::forward<Args>(args)...));
+    }
+
+    /*
+     * Moves the callables in [first, last) into the channel, publishing
+     * them as few batches as the free room allows.
+     */
+    template<typename It>
+    void push_bulk(It first, It last)
+    {
+        task batch[B];
+        while(first != last)
+        {
+            unsigned int n = 0;
+            for(; n < B && first != last; ++n, ++first)
+                batch[n] = task(std::move(*first));
+            m_queue->push_bulk(batch, batch + n);
+        }
+    }
+
+    /*
+     * Queues the end marker, the worker leaves once it gets there.
+     */
+    void close()
+    {
+        if(m_closed)
+            return;
+        m_closed = true;
+        m_queue->push(task());
+    }
+
+private:
+    using queue = atomic_blocking_queue<task, spsc_ring<task, Q_SIZE>, S>;
+    inline static const unsigned int B = 64;
+
+    template<typename F, typename... Args>
+    static task bind(F&& f, Args&&... args)
+    {
+        if constexpr(sizeof...(Args) == 0)
+            return task(std::forward<F>(f));
+        else
+            return task([p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable { std::apply(p, t); });
+    }
+
+    static void drain(queue& q)
+    {
+        task batch[B];
+        while(true)
+        {
+            const auto n = q.pop_bulk(batch, B);
+            for(unsigned int i = 0; i < n; ++i)
+            {
+                if(!batch[i])
+                    return;
+                batch[i]();
+                batch[i] = task();
+            }
+            if(!n)
+                return;
+        }
+    }
+
+    std::shared_ptr<queue> m_queue;
+    bool m_closed = false;
+};
@@ -0,0 +1,685 @@
+/*
+ * ------------------------------------------------------------------------
+ * C++20 coroutines on the pools, built with -DWITH_COROUTINES=ON.
+ *
+ * co_await pool.schedule() suspends the calling coroutine and submits its
+ * resumption to the pool, so everything after it runs on a worker.
+ *
+ * pool_task<T> is a lazy coroutine: nothing runs until it is awaited (or
+ * passed to sync_wait()), and the awaiting coroutine is resumed by the
+ * task's final suspend through symmetric transfer. A chain of awaited
+ * tasks hence runs on whichever worker the innermost one was scheduled on,
+ * each hop a jump between frames rather than a trip through the pool's
+ * queues, and it only goes back to the pool where a coroutine asks for it
+ * with schedule(). Frames are allocated from the task arena (see
+ * task_arena.h).
+ *
+ * when_all() starts every task and completes with all their results once
+ * the last one finishes, on the worker that finished it. when_any()
+ * completes with the index and result of the first task to finish; the
+ * others still run to completion, their results are dropped. Tasks only
+ * run concurrently past their first schedule(), up to there they run one
+ * after the other on the thread starting them. An exception is rethrown
+ * by the co_await that would have returned the result, for when_all() the
+ * one of the first task in argument order which failed.
+ *
+ * sync_wait() starts a task from a thread outside the pool and blocks
+ * until it finishes. Calling it from a worker of the pool the task
+ * schedules on may deadlock.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "pool_coroutine.h needs C++20 coroutines, configure with -DWITH_COROUTINES=ON!"
+#endif
+
+#include <tuple>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <variant>
+#include <optional>
+#include <exception>
+#include <stdexcept>
+#include <coroutine>
+#include <type_traits>
+#include <condition_variable>
+#include "task_arena.h"
+#include "pool_future.h"
+
+/*
+ * What co_await pool.schedule() waits on.
+ */
+class schedule_awaitable
+{
+public:
+    explicit schedule_awaitable(task_executor executor) noexcept
+    : m_executor(executor)
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) const
+    {
+        m_executor([handle]() { handle.resume(); });
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+private:
+    task_executor m_executor;
+};
+
+/*
+ * Coroutine frames come from the arena of the thread starting them and go
+ * back to it from wherever they finish.
+ */
+struct arena_frame
+{
+    static void* operator new(std::size_t size)
+    {
+        return task_arena::allocate(size);
+    }
+
+    static void operator delete(void* p, std::size_t size) noexcept
+    {
+        task_arena::deallocate(p, size);
+    }
+};
+
+template<typename T>
+class pool_task;
+
+template<typename T>
+T sync_wait(pool_task<T> task);
+
+/*
+ * Result types of when_all()/when_any(), std::monostate for void.
+ */
+template<typename T>
+using task_result_t = std::conditional_t<std::is_void<T>::value, std::monostate, T>;
+
+template<typename T>
+struct when_any_result
+{
+    std::size_t index;
+    task_result_t<T> value;
+};
+
+template<typename T>
+class pool_task
+{
+    class promise_base : public arena_frame
+    {
+    public:
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        /*
+         * Jumps straight into the awaiter, if any.
+         */
+        struct transfer
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            template<typename P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+            {
+                return handle.promise().m_continuation;
+            }
+
+            void await_resume() noexcept
+            {
+            }
+        };
+
+        transfer final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void unhandled_exception() noexcept
+        {
+            m_error = std::current_exception();
+        }
+
+        std::coroutine_handle<> m_continuation = std::noop_coroutine();
+        std::exception_ptr m_error;
+    };
+
+    class value_promise : public promise_base
+    {
+    public:
+        template<typename U>
+        void return_value(U&& value)
+        {
+            m_value.emplace(std::forward<U>(value));
+        }
+
+        T result()
+        {
+            if(this->m_error)
+                std::rethrow_exception(this->m_error);
+            return std::move(*m_value);
+        }
+
+    private:
+        std::optional<T> m_value;
+    };
+
+    class void_promise : public promise_base
+    {
+    public:
+        void return_void() noexcept
+        {
+        }
+
+        void result()
+        {
+            if(this->m_error)
+                std::rethrow_exception(this->m_error);
+        }
+    };
+
+public:
+    class promise_type : public std::conditional_t<std::is_void<T>::value, void_promise, value_promise>
+    {
+    public:
+        pool_task get_return_object() noexcept
+        {
+            return pool_task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    pool_task() noexcept = default;
+
+    pool_task(pool_task&& other) noexcept
+    : m_handle(std::exchange(other.m_handle, nullptr))
+    {
+    }
+
+    pool_task& operator=(pool_task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(m_handle)
+                m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+
+    pool_task(const pool_task&) = delete;
+    pool_task& operator=(const pool_task&) = delete;
+
+    ~pool_task()
+    {
+        if(m_handle)
+            m_handle.destroy();
+    }
+
+    bool valid() const noexcept
+    {
+        return static_cast<bool>(m_handle);
+    }
+
+    /*
+     * Starts the task and resumes the awaiter with its result. Awaiting a
+     * finished task returns its result right away.
+     */
+    auto operator co_await() noexcept
+    {
+        struct awaiter : ready
+        {
+            decltype(auto) await_resume()
+            {
+                return this->m_handle.promise().result();
+            }
+        };
+        return awaiter{{m_handle}};
+    }
+
+    /*
+     * Starts the task and resumes the awaiter once it has finished, leaving
+     * the result in the task.
+     */
+    auto when_ready() noexcept
+    {
+        return ready{m_handle};
+    }
+
+private:
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    struct ready
+    {
+        handle_type m_handle;
+
+        bool await_ready() const noexcept
+        {
+            return m_handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+        {
+            m_handle.promise().m_continuation = awaiter;
+            return m_handle;
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    explicit pool_task(handle_type handle) noexcept
+    : m_handle(handle)
+    {
+    }
+
+    template<typename U>
+    friend U sync_wait(pool_task<U> task);
+
+    template<typename U>
+    friend task_result_t<U> take_result(pool_task<U>& task);
+
+    handle_type m_handle;
+};
+
+/*
+ * The result of a finished task, moved out of it.
+ */
+template<typename T>
+task_result_t<T> take_result(pool_task<T>& task)
+{
+    if constexpr(std::is_void<T>::value)
+    {
+        task.m_handle.promise().result();
+        return {};
+    }
+    else
+        return task.m_handle.promise().result();
+}
+
+/*
+ * Runs a body awaiting one task and destroys itself when done, handing
+ * the thread on to whatever its promise's arrive() returns.
+ */
+template<typename Arrival>
+class task_driver
+{
+public:
+    class promise_type : public arena_frame
+    {
+    public:
+        template<typename... Args>
+        promise_type(Arrival& arrival, Args&...) noexcept
+        : m_arrival(&arrival)
+        {
+        }
+
+        task_driver get_return_object() noexcept
+        {
+            return task_driver(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        auto final_suspend() noexcept
+        {
+            struct arrive
+            {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+                {
+                    auto next = handle.promise().m_arrival->arrive();
+                    handle.destroy();
+                    return next;
+                }
+
+                void await_resume() noexcept
+                {
+                }
+            };
+            return arrive{};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+
+    private:
+        Arrival* m_arrival;
+    };
+
+    void start() noexcept
+    {
+        m_handle.resume();
+    }
+
+private:
+    explicit task_driver(std::coroutine_handle<promise_type> handle) noexcept
+    : m_handle(handle)
+    {
+    }
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/*
+ * Counts the tasks of a when_all() plus the coroutine starting them down,
+ * whoever comes last resumes the awaiter.
+ */
+class when_all_latch
+{
+public:
+    explicit when_all_latch(std::size_t count) noexcept
+    : m_count(count + 1)
+    {
+    }
+
+    /*
+     * False, so the awaiter goes on right away, if every task finished
+     * while being started.
+     */
+    template<typename F>
+    bool suspend(std::coroutine_handle<> awaiter, F&& start) noexcept
+    {
+        m_awaiter = awaiter;
+        start();
+        return m_count.fetch_sub(1, std::memory_order_acq_rel) > 1;
+    }
+
+    std::coroutine_handle<> arrive() noexcept
+    {
+        if(m_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            return m_awaiter;
+        return std::noop_coroutine();
+    }
+
+private:
+    std::atomic<std::size_t> m_count;
+    std::coroutine_handle<> m_awaiter;
+};
+
+template<typename T>
+task_driver<when_all_latch> when_all_drive([[maybe_unused]] when_all_latch& latch, pool_task<T>& task)
+{
+    co_await task.when_ready();
+}
+
+/*
+ * Completes with the results of all tasks once the last one finishes.
+ */
+template<typename... T>
+pool_task<std::tuple<task_result_t<T>...>> when_all(pool_task<T>... tasks)
+{
+    when_all_latch latch(sizeof...(T));
+
+    struct start_all
+    {
+        when_all_latch& latch;
+        std::tuple<pool_task<T>&...> tasks;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> awaiter) noexcept
+        {
+            return latch.suspend(awaiter, [this]()
+            {
+                std::apply([this](auto&... t) { (when_all_drive(latch, t).start(), ...); }, tasks);
+            });
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+    co_await start_all{latch, std::tie(tasks...)};
+
+    // Braces, so the first failed task in argument order throws.
+    co_return std::tuple<task_result_t<T>...>{take_result(tasks)...};
+}
+
+/*
+ * Completes with the results of all tasks, in order, once the last one
+ * finishes.
+ */
+template<typename T>
+pool_task<std::vector<task_result_t<T>>> when_all(std::vector<pool_task<T>> tasks)
+{
+    when_all_latch latch(tasks.size());
+
+    struct start_all
+    {
+        when_all_latch& latch;
+        std::vector<pool_task<T>>& tasks;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> awaiter) noexcept
+        {
+            return latch.suspend(awaiter, [this]()
+            {
+                for(auto& t : tasks)
+                    when_all_drive(latch, t).start();
+            });
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+    co_await start_all{latch, tasks};
+
+    std::vector<task_result_t<T>> results;
+    results.reserve(tasks.size());
+    for(auto& t : tasks)
+        results.push_back(take_result(t));
+    co_return results;
+}
+
+/*
+ * Shared by when_any() and its tasks, which may outlive it. The first task
+ * to finish hands itself over, the awaiter is resumed by whichever of it
+ * and the coroutine starting the tasks comes second.
+ */
+template<typename T>
+class when_any_state
+{
+public:
+    template<typename F>
+    bool suspend(std::coroutine_handle<> awaiter, F&& start) noexcept
+    {
+        m_awaiter = awaiter;
+        start();
+        return m_pending.fetch_sub(1, std::memory_order_acq_rel) > 1;
+    }
+
+    std::coroutine_handle<> finish(std::size_t index, pool_task<T>& task) noexcept
+    {
+        if(m_won.exchange(true, std::memory_order_relaxed))
+            return std::noop_coroutine();
+
+        m_index = index;
+        m_winner = std::move(task);
+        if(m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            return m_awaiter;
+        return std::noop_coroutine();
+    }
+
+    when_any_result<T> result()
+    {
+        return { m_index, take_result(m_winner) };
+    }
+
+private:
+    std::atomic<bool> m_won = false;
+    std::atomic<int> m_pending = 2;
+    std::coroutine_handle<> m_awaiter;
+    std::size_t m_index = 0;
+    pool_task<T> m_winner;
+};
+
+/*
+ * Owns its task and a reference to the state, the task_driver reports to
+ * the state through arrive().
+ */
+template<typename T>
+class when_any_arrival
+{
+public:
+    when_any_arrival(std::shared_ptr<when_any_state<T>> state, std::size_t index, pool_task<T>&& task) noexcept
+    : m_state(std::move(state)), m_index(index), m_task(std::move(task))
+    {
+    }
+
+    std::coroutine_handle<> arrive() noexcept
+    {
+        return m_state->finish(m_index, m_task);
+    }
+
+    pool_task<T>& task() noexcept
+    {
+        return m_task;
+    }
+
+private:
+    std::shared_ptr<when_any_state<T>> m_state;
+    std::size_t m_index;
+    pool_task<T> m_task;
+};
+
+template<typename T>
+task_driver<when_any_arrival<T>> when_any_drive(when_any_arrival<T> arrival)
+{
+    co_await arrival.task().when_ready();
+}
+
+/*
+ * Completes with the index and result of the first task to finish.
+ */
+template<typename T>
+pool_task<when_any_result<T>> when_any(std::vector<pool_task<T>> tasks)
+{
+    if(tasks.empty())
+        throw std::invalid_argument("Invalid task count!");
+
+    auto state = std::make_shared<when_any_state<T>>();
+
+    struct start_all
+    {
+        std::shared_ptr<when_any_state<T>>& state;
+        std::vector<pool_task<T>>& tasks;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> awaiter) noexcept
+        {
+            return state->suspend(awaiter, [this]()
+            {
+                for(std::size_t i = 0; i < tasks.size(); ++i)
+                    when_any_drive(when_any_arrival<T>(state, i, std::move(tasks[i]))).start();
+            });
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+    co_await start_all{state, tasks};
+
+    co_return state->result();
+}
+
+template<typename T, typename... Rest>
+pool_task<when_any_result<T>> when_any(pool_task<T> first, pool_task<Rest>... rest)
+{
+    static_assert((std::is_same<T, Rest>::value && ...), "when_any() needs tasks of one result type!");
+
+    std::vector<pool_task<T>> tasks;
+    tasks.reserve(1 + sizeof...(Rest));
+    tasks.push_back(std::move(first));
+    (tasks.push_back(std::move(rest)), ...);
+    return when_any(std::move(tasks));
+}
+
+/*
+ * Tells the thread in sync_wait() the task has finished. It notifies under
+ * the lock, as that thread destroys the condition variable right after.
+ */
+class sync_arrival
+{
+public:
+    std::coroutine_handle<> arrive() noexcept
+    {
+        std::scoped_lock lock(m_mutex);
+        m_done = true;
+        m_cv.notify_one();
+        return std::noop_coroutine();
+    }
+
+    void wait() noexcept
+    {
+        std::unique_lock lock(m_mutex);
+        m_cv.wait(lock, [this]() { return m_done; });
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_done = false;
+};
+
+template<typename T>
+task_driver<sync_arrival> sync_drive([[maybe_unused]] sync_arrival& arrival, pool_task<T>& task)
+{
+    co_await task.when_ready();
+}
+
+/*
+ * Runs task and blocks until it has finished, returning its result.
+ */
+template<typename T>
+T sync_wait(pool_task<T> task)
+{
+    sync_arrival arrival;
+    sync_drive(arrival, task).start();
+    arrival.wait();
+    return task.m_handle.promise().result();
+}
@@ -0,0 +1,408 @@
+/*
+ * ------------------------------------------------------------------------
+ * Future and promise returned by the pools' enqueue_task.
+ *
+ * Same get()/wait()/wait_for()/wait_until() as std::future, plus then():
+ * the continuation is handed to the pool the task came from as soon as the
+ * result is there, so chaining work never parks a worker on get(). As with
+ * the concurrency TS, the continuation receives the ready future and then()
+ * consumes the future it is called on.
+ *
+ * The shared state is reference counted in place and lives in the task
+ * arena (see task_arena.h): a state released on another thread (typically
+ * the worker, when it drops the promise after the caller has already taken
+ * the result) goes back to the cache of the thread which allocated it, so
+ * a steady request/response load stops allocating. Readiness is one
+ * atomic flag word: waiters sleep on it with a futex (a yield loop
+ * elsewhere) and the continuation hand off is a single fetch_or, no mutex
+ * or condition variable anywhere.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <utility>
+#include <optional>
+#include <exception>
+#include <type_traits>
+#include <limits.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#include "task_arena.h"
+#include "unique_task.h"
+
+/*
+ * Type erased "run this on the pool".
+ */
+struct task_executor
+{
+    void* pool = nullptr;
+    void (*submit)(void* pool, unique_task<void(void)>&& task) = nullptr;
+
+    void operator()(unique_task<void(void)>&& task) const
+    {
+        submit(pool, std::move(task));
+    }
+};
+
+template<typename T>
+class pool_future;
+
+template<typename T>
+class task_state
+{
+public:
+    /*
+     * A new state with a single reference.
+     */
+    static task_state* acquire(task_executor executor)
+    {
+        auto state = new task_state();
+        state->m_executor = executor;
+        state->m_refs.store(1, std::memory_order_relaxed);
+        return state;
+    }
+
+    static void* operator new(std::size_t size)
+    {
+        return task_arena::allocate(size, alignof(task_state));
+    }
+
+    static void operator delete(void* p, std::size_t size) noexcept
+    {
+        task_arena::deallocate(p, size, alignof(task_state));
+    }
+
+    void add_ref() noexcept
+    {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() noexcept
+    {
+        if(m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    /*
+     * Stores whatever f returns, or throws.
+     */
+    template<typename F>
+    void fulfil(F&& f) noexcept
+    {
+        try
+        {
+            if constexpr(std::is_void<T>::value)
+            {
+                std::forward<F>(f)();
+                m_value.emplace();
+            }
+            else
+                m_value.emplace(std::forward<F>(f)());
+        }
+        catch(...)
+        {
+            m_error = std::current_exception();
+        }
+        complete();
+    }
+
+    void fail(std::exception_ptr error) noexcept
+    {
+        m_error = error;
+        complete();
+    }
+
+    bool ready() const noexcept
+    {
+        return m_flags.load(std::memory_order_acquire) & READY;
+    }
+
+    void wait() const noexcept
+    {
+        int flags = m_flags.load(std::memory_order_acquire);
+        while(!(flags & READY))
+        {
+            if(!announce(flags))
+                continue;
+            futex_wait(flags | WAITING, nullptr);
+            flags = m_flags.load(std::memory_order_acquire);
+        }
+    }
+
+    template<typename Clock, typename Duration>
+    bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline) const noexcept
+    {
+        int flags = m_flags.load(std::memory_order_acquire);
+        while(!(flags & READY))
+        {
+            auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count();
+            if(left <= 0)
+                return false;
+            if(!announce(flags))
+                continue;
+
+            timespec timeout;
+            timeout.tv_sec = static_cast<time_t>(left / 1000000000);
+            timeout.tv_nsec = static_cast<long>(left % 1000000000);
+            futex_wait(flags | WAITING, &timeout);
+            flags = m_flags.load(std::memory_order_acquire);
+        }
+        return true;
+    }
+
+    T get()
+    {
+        wait();
+        if(m_error)
+            std::rethrow_exception(m_error);
+        if constexpr(!std::is_void<T>::value)
+            return std::move(*m_value);
+    }
+
+    /*
+     * Runs continuation on the executor once ready, right away if it is.
+     * Whoever sets its flag second, us or complete(), submits it.
+     */
+    void on_ready(unique_task<void(void)>&& continuation)
+    {
+        m_continuation = std::move(continuation);
+        if(m_flags.fetch_or(CONTINUED, std::memory_order_acq_rel) & READY)
+            m_executor(std::move(m_continuation));
+    }
+
+    task_executor executor() const noexcept
+    {
+        return m_executor;
+    }
+
+private:
+    static constexpr int READY = 1;
+    static constexpr int WAITING = 2;
+    static constexpr int CONTINUED = 4;
+
+    struct empty {};
+    using value_type = std::conditional_t<std::is_void<T>::value, empty, T>;
+
+    task_state() = default;
+
+    /*
+     * The promise holds its reference until this returns, the flag word
+     * stays valid for the wake even if the future is gone by then.
+     */
+    void complete() noexcept
+    {
+        const int flags = m_flags.fetch_or(READY, std::memory_order_acq_rel);
+        if(flags & WAITING)
+            futex_wake();
+        if(flags & CONTINUED)
+            m_executor(std::move(m_continuation));
+    }
+
+    /*
+     * Sets WAITING before sleeping, false if the flags changed meanwhile.
+     */
+    bool announce(int& flags) const noexcept
+    {
+        return (flags & WAITING) ||
+               m_flags.compare_exchange_weak(flags, flags | WAITING, std::memory_order_acquire);
+    }
+
+#ifdef __linux__
+    void futex_wait(int expected, const timespec* timeout) const noexcept
+    {
+        syscall(SYS_futex, reinterpret_cast<const int*>(&m_flags), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+    }
+
+    void futex_wake() noexcept
+    {
+        syscall(SYS_futex, reinterpret_cast<int*>(&m_flags), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    static_assert(sizeof(std::atomic_int) == sizeof(int), "futex needs a plain int flag word!");
+#else
+    void futex_wait(int, const void*) const noexcept
+    {
+        std::this_thread::yield();
+    }
+
+    void futex_wake() noexcept {}
+#endif
+
+    mutable std::atomic_int m_flags = 0;
+    std::atomic_uint m_refs = 0;
+    std::optional<value_type> m_value;
+    std::exception_ptr m_error;
+    unique_task<void(void)> m_continuation;
+    task_executor m_executor;
+};
+
+/*
+ * Write end, owned by the queued task. Dropping it unfulfilled, e.g. when
+ * the task is discarded by a pool shutting down, breaks the promise.
+ */
+template<typename T>
+class pool_promise
+{
+public:
+    explicit pool_promise(task_executor executor)
+    : m_state(task_state<T>::acquire(executor))
+    {
+    }
+
+    pool_promise(pool_promise&& other) noexcept
+    : m_state(std::exchange(other.m_state, nullptr))
+    {
+    }
+
+    pool_promise& operator=(pool_promise&& other) noexcept
+    {
+        if(this != &other)
+        {
+            abandon();
+            m_state = std::exchange(other.m_state, nullptr);
+        }
+        return *this;
+    }
+
+    ~pool_promise() noexcept
+    {
+        abandon();
+    }
+
+    pool_future<T> get_future() const
+    {
+        m_state->add_ref();
+        return pool_future<T>(m_state);
+    }
+
+    template<typename F>
+    void fulfil(F&& f) noexcept
+    {
+        m_state->fulfil(std::forward<F>(f));
+        std::exchange(m_state, nullptr)->release();
+    }
+
+    void fail(std::exception_ptr error) noexcept
+    {
+        m_state->fail(error);
+        std::exchange(m_state, nullptr)->release();
+    }
+
+private:
+    void abandon() noexcept
+    {
+        if(m_state)
+            fail(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+    }
+
+    task_state<T>* m_state;
+};
+
+template<typename T>
+class pool_future
+{
+public:
+    pool_future() noexcept = default;
+
+    /*
+     * Adopts one reference to state.
+     */
+    explicit pool_future(task_state<T>* state) noexcept
+    : m_state(state)
+    {
+    }
+
+    pool_future(pool_future&& other) noexcept
+    : m_state(std::exchange(other.m_state, nullptr))
+    {
+    }
+
+    pool_future& operator=(pool_future&& other) noexcept
+    {
+        if(this != &other)
+        {
+            if(m_state)
+                m_state->release();
+            m_state = std::exchange(other.m_state, nullptr);
+        }
+        return *this;
+    }
+
+    ~pool_future() noexcept
+    {
+        if(m_state)
+            m_state->release();
+    }
+
+    bool valid() const noexcept
+    {
+        return m_state != nullptr;
+    }
+
+    bool is_ready() const
+    {
+        return state().ready();
+    }
+
+    void wait() const
+    {
+        state().wait();
+    }
+
+    template<typename Rep, typename Period>
+    std::future_status wait_for(const std::chrono::duration<Rep, Period>& timeout) const
+    {
+        return wait_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Clock, typename Duration>
+    std::future_status wait_until(const std::chrono::time_point<Clock, Duration>& deadline) const
+    {
+        return state().wait_until(deadline) ? std::future_status::ready : std::future_status::timeout;
+    }
+
+    T get()
+    {
+        pool_future self(std::move(*this));
+        return self.state().get();
+    }
+
+    /*
+     * Schedules f(ready future) on the same pool and returns the future of
+     * its result. Leaves this future invalid.
+     */
+    template<typename F>
+    auto then(F&& f) -> pool_future<std::invoke_result_t<F, pool_future<T>>>
+    {
+        using R = std::invoke_result_t<F, pool_future<T>>;
+
+        pool_future self(std::move(*this));
+        auto& ready = self.state();
+
+        pool_promise<R> promise(ready.executor());
+        auto result = promise.get_future();
+        ready.on_ready([promise = std::move(promise), f = std::forward<F>(f), self = std::move(self)]() mutable
+        {
+            promise.fulfil([&]() { return f(std::move(self)); });
+        });
+        return result;
+    }
+
+private:
+    task_state<T>& state() const
+    {
+        if(!m_state)
+            throw std::future_error(std::future_errc::no_state);
+        return *m_state;
+    }
+
+    task_state<T>* m_state = nullptr;
+};
@@ -0,0 +1,156 @@
+/*
+ * ------------------------------------------------------------------------
+ * Phase control of a pool: waiting for it to go idle, and pausing it.
+ *
+ * The pool counts every task from submission until it has run. wait_idle()
+ * returns once that count is 0, so every queue is empty and no task is
+ * running, and takes tasks off the queues and runs them itself while there
+ * are any, rather than sleeping next to a backlog. The workers stay, so a
+ * pool can go through any number of submit and wait_idle() phases.
+ *
+ * pause() stops the workers from starting tasks; what is running finishes,
+ * what is submitted stays queued until resume(). A worker which already
+ * took a task when the pool was paused leaves it here for resume(), or for
+ * wait_idle(), which on a paused pool runs everything on the caller.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <stdexcept>
+#include <condition_variable>
+#include "unique_task.h"
+
+class pool_phase
+{
+public:
+    using task = unique_task<void(void)>;
+
+    /*
+     * Before n tasks are queued.
+     */
+    void submitted(std::uint64_t n = 1) noexcept
+    {
+        m_pending.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /*
+     * After n tasks have run, or have been dropped.
+     */
+    void finished(std::uint64_t n = 1) noexcept
+    {
+        const auto left = m_pending.fetch_sub(n) - n;
+        // Pairs with the waiter announcing itself before it checks m_pending.
+        if(m_waiters.load() && (!left || paused()))
+        {
+            std::scoped_lock lock(m_mutex);
+            m_changed.notify_all();
+        }
+    }
+
+    bool idle() const noexcept
+    {
+        return !m_pending.load(std::memory_order_acquire);
+    }
+
+    bool paused() const noexcept
+    {
+        return m_paused.load(std::memory_order_relaxed);
+    }
+
+    void pause() noexcept
+    {
+        std::scoped_lock lock(m_mutex);
+        m_paused.store(true, std::memory_order_relaxed);
+    }
+
+    void resume() noexcept
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_paused.store(false, std::memory_order_relaxed);
+        }
+        m_resumed.notify_all();
+    }
+
+    /*
+     * Called by a worker holding f once paused() says so: parks f until
+     * resume() and hands the worker back a held task, possibly another one,
+     * or none if wait_idle() has run them meanwhile.
+     */
+    void hold(task& f)
+    {
+        std::unique_lock lock(m_mutex);
+        if(!paused())
+            return;
+        m_held.push_back(std::exchange(f, task()));
+        m_changed.notify_all();
+        m_resumed.wait(lock, [this]() { return !paused(); });
+        if(!m_held.empty())
+        {
+            f = std::move(m_held.back());
+            m_held.pop_back();
+        }
+    }
+
+    /*
+     * take(f) moves a queued task into f, false if it finds none.
+     */
+    template<typename Take>
+    void wait_idle(Take&& take)
+    {
+        // A task run here would wait for itself.
+        if(t_helping == this)
+            throw std::logic_error("wait_idle() called from a task of the pool!");
+
+        task f;
+        while(!idle())
+        {
+            if((paused() && take_held(f)) || take(f))
+            {
+                const auto helping = std::exchange(t_helping, this);
+                f();
+                t_helping = helping;
+                f = task();
+                finished();
+                continue;
+            }
+
+            // Whatever is left is running, or held while paused.
+            std::unique_lock lock(m_mutex);
+            m_waiters.fetch_add(1);
+            // The timeout only guards against take() failing spuriously on a
+            // contended queue and against submitters outside the pool while
+            // paused, regular wake ups come from finished() and hold().
+            if(!idle() && !(paused() && !m_held.empty()))
+                m_changed.wait_for(lock, std::chrono::milliseconds(10));
+            m_waiters.fetch_sub(1);
+        }
+    }
+
+private:
+    bool take_held(task& f)
+    {
+        std::scoped_lock lock(m_mutex);
+        if(m_held.empty())
+            return false;
+        f = std::move(m_held.back());
+        m_held.pop_back();
+        return true;
+    }
+
+    alignas(64) std::atomic<std::uint64_t> m_pending = 0;
+    alignas(64) std::atomic_uint m_waiters = 0;
+    std::atomic_bool m_paused = false;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::condition_variable m_resumed;
+    std::vector<task> m_held;
+
+    inline static thread_local const pool_phase* t_helping = nullptr;
+};
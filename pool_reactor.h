@@ -0,0 +1,243 @@
+/*
+ * ------------------------------------------------------------------------
+ * epoll reactor dispatching file descriptor readiness as pool tasks.
+ *
+ * watch(fd, events, callback) registers fd one shot (EPOLLONESHOT): once
+ * it is ready the callback is submitted to the pool with the ready events
+ * and fd is only rearmed after the callback has returned, so callbacks of
+ * one fd never overlap and a level triggered fd does not flood the pool
+ * while its callback waits in a queue. unwatch(fd) disarms fd; a callback
+ * already submitted still runs, fd is just not rearmed after it.
+ * Callbacks must not throw.
+ *
+ * Somebody has to sit in epoll_wait. A thread_pool whose workers park
+ * (work stealing or lanes > 1) has one of its idle workers do it instead
+ * of sleeping on its condition variable: wake() kicks that worker out
+ * through an eventfd when work comes in, and the callbacks it dispatches
+ * land on its own deque, so it normally runs them itself, without any
+ * hand off. While every worker is busy nobody polls, readiness is picked
+ * up by the next worker going idle. Other pools lend a worker for as long
+ * as they live, which polls and runs what lands on its own queue in turn,
+ * and any thread of your own can call run() or poll() just as well.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cerrno>
+#include <cstdint>
+#include <utility>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "pool_future.h"
+#include "unique_task.h"
+
+class pool_reactor
+{
+public:
+    using callback = unique_task<void(unsigned int)>;
+
+    // Events taken per epoll_wait.
+    static constexpr unsigned int max_events = 64;
+
+    explicit pool_reactor(task_executor executor)
+    : m_executor(executor)
+    {
+        m_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if(m_epoll < 0)
+            throw std::system_error(errno, std::generic_category(), "epoll_create1");
+
+        m_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u64 = wakeup_key;
+        if(m_wakeup < 0 || epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &event) < 0)
+        {
+            const auto error = errno;
+            if(m_wakeup >= 0)
+                close(m_wakeup);
+            close(m_epoll);
+            throw std::system_error(error, std::generic_category(), "eventfd");
+        }
+    }
+
+    pool_reactor(const pool_reactor&) = delete;
+    pool_reactor& operator=(const pool_reactor&) = delete;
+
+    ~pool_reactor()
+    {
+        close(m_wakeup);
+        close(m_epoll);
+    }
+
+    /*
+     * Calls f(ready events) on the pool whenever fd is ready for any of
+     * events (EPOLLIN, EPOLLOUT, ...). An fd is watched at most once.
+     */
+    void watch(int fd, unsigned int events, callback f)
+    {
+        if(fd < 0)
+            throw std::invalid_argument("Invalid file descriptor!");
+
+        auto w = std::make_shared<watcher>();
+        w->fd = fd;
+        w->events = events | EPOLLONESHOT;
+        w->f = std::move(f);
+
+        std::scoped_lock lock(m_mutex);
+        if(m_watchers.count(fd))
+            throw std::invalid_argument("Invalid file descriptor!");
+
+        // The generation tells a stale event of an earlier watcher of the
+        // same fd number from one of this watcher.
+        w->key = (++m_generation << 32) | static_cast<std::uint32_t>(fd);
+        if(!arm(*w, EPOLL_CTL_ADD))
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+        m_watchers.emplace(fd, std::move(w));
+    }
+
+    /*
+     * False if fd is not watched.
+     */
+    bool unwatch(int fd) noexcept
+    {
+        std::scoped_lock lock(m_mutex);
+        auto it = m_watchers.find(fd);
+        if(it == m_watchers.end())
+            return false;
+        // Fails harmlessly if fd has been closed already.
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        m_watchers.erase(it);
+        return true;
+    }
+
+    /*
+     * Waits up to timeout_ms (-1 for ever) and submits the callbacks of the
+     * ready fds, returning how many it submitted.
+     */
+    unsigned int poll(int timeout_ms)
+    {
+        epoll_event events[max_events];
+        return dispatch(events, wait(events, max_events, timeout_ms));
+    }
+
+    /*
+     * Polls until stop().
+     */
+    void run()
+    {
+        while(!stopped())
+            poll(-1);
+    }
+
+    void stop() noexcept
+    {
+        m_stopped.store(true, std::memory_order_release);
+        notify();
+    }
+
+    bool stopped() const noexcept
+    {
+        return m_stopped.load(std::memory_order_acquire);
+    }
+
+    /*
+     * Wakes a thread in epoll_wait, or the next one to get there.
+     */
+    void notify() noexcept
+    {
+        const std::uint64_t one = 1;
+        [[maybe_unused]] const auto written = write(m_wakeup, &one, sizeof(one));
+    }
+
+    /*
+     * poll() in two halves, for a pool which has to do its own book keeping
+     * between waking up and submitting.
+     */
+    unsigned int wait(epoll_event* events, unsigned int max, int timeout_ms) noexcept
+    {
+        const auto n = epoll_wait(m_epoll, events, static_cast<int>(max), timeout_ms);
+        return n < 0 ? 0 : static_cast<unsigned int>(n);
+    }
+
+    unsigned int dispatch(const epoll_event* events, unsigned int n)
+    {
+        unsigned int submitted = 0;
+        for(unsigned int i = 0; i < n; ++i)
+        {
+            const auto key = events[i].data.u64;
+            if(key == wakeup_key)
+            {
+                // Left set once stopped, so every thread in run() sees it.
+                if(!m_stopped.load(std::memory_order_acquire))
+                {
+                    std::uint64_t count;
+                    [[maybe_unused]] const auto drained = read(m_wakeup, &count, sizeof(count));
+                }
+                continue;
+            }
+
+            std::shared_ptr<watcher> w;
+            {
+                std::scoped_lock lock(m_mutex);
+                auto it = m_watchers.find(static_cast<int>(key & 0xffffffffu));
+                if(it == m_watchers.end() || it->second->key != key)
+                    continue;
+                w = it->second;
+            }
+
+            m_executor([this, w = std::move(w), ready = events[i].events]()
+            {
+                w->f(ready);
+                rearm(*w);
+            });
+            ++submitted;
+        }
+        return submitted;
+    }
+
+private:
+    static constexpr std::uint64_t wakeup_key = ~std::uint64_t(0);
+
+    struct watcher
+    {
+        int fd;
+        unsigned int events;
+        std::uint64_t key;
+        callback f;
+    };
+
+    bool arm(watcher& w, int op) noexcept
+    {
+        epoll_event event{};
+        event.events = w.events;
+        event.data.u64 = w.key;
+        return epoll_ctl(m_epoll, op, w.fd, &event) == 0;
+    }
+
+    /*
+     * Unless w has been unwatched while its callback ran.
+     */
+    void rearm(watcher& w) noexcept
+    {
+        std::scoped_lock lock(m_mutex);
+        auto it = m_watchers.find(w.fd);
+        if(it != m_watchers.end() && it->second.get() == &w)
+            arm(w, EPOLL_CTL_MOD);
+    }
+
+    task_executor m_executor;
+    int m_epoll = -1;
+    int m_wakeup = -1;
+    std::atomic<bool> m_stopped = false;
+
+    std::mutex m_mutex;
+    std::unordered_map<int, std::shared_ptr<watcher>> m_watchers;
+    std::uint64_t m_generation = 0;
+};
@@ -0,0 +1,190 @@
+/*
+ * Opt-in thread pool instrumentation.
+ *
+ * Latencies go into HDR-style log-linear histograms: values below 2^S are
+ * counted exactly, above that every power of two is split into 2^(S-1)
+ * linear sub-buckets, so any recorded value is off by at most 1/2^(S-1)
+ * (about 6% for S = 5) while the whole 64 bit range fits in 976 buckets.
+ *
+ * https://github.com/HdrHistogram/HdrHistogram
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+class latency_histogram
+{
+public:
+    static constexpr unsigned int S = 5;
+    static constexpr unsigned int H = 1u << (S - 1);
+    static constexpr unsigned int BUCKETS = (64 - S + 2) * H;
+
+    static unsigned int bucket(std::uint64_t value) noexcept
+    {
+        if(value < 2 * H)
+            return static_cast<unsigned int>(value);
+        const unsigned int msb = 63 - __builtin_clzll(value);
+        const unsigned int shift = msb - (S - 1);
+        return shift * H + static_cast<unsigned int>(value >> shift);
+    }
+
+    static std::uint64_t lower_bound(unsigned int index) noexcept
+    {
+        if(index < 2 * H)
+            return index;
+        const unsigned int shift = index / H - 1;
+        return static_cast<std::uint64_t>(index - shift * H) << shift;
+    }
+
+    latency_histogram() : m_buckets(BUCKETS, 0) {}
+
+    void record(std::uint64_t value) noexcept
+    {
+        ++m_buckets[bucket(value)];
+        ++m_count;
+        m_sum += value;
+        m_max = std::max(m_max, value);
+    }
+
+    void add(unsigned int index, std::uint64_t count) noexcept
+    {
+        m_buckets[index] += count;
+        m_count += count;
+    }
+
+    void add_totals(std::uint64_t sum, std::uint64_t max) noexcept
+    {
+        m_sum += sum;
+        m_max = std::max(m_max, max);
+    }
+
+    void merge(const latency_histogram& other) noexcept
+    {
+        for(unsigned int i = 0; i < BUCKETS; ++i)
+            m_buckets[i] += other.m_buckets[i];
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    /*
+     * Lower bound of the bucket holding the p-th quantile, p in [0, 1].
+     */
+    std::uint64_t percentile(double p) const noexcept
+    {
+        if(!m_count)
+            return 0;
+        const auto rank = static_cast<std::uint64_t>(p * (m_count - 1)) + 1;
+        std::uint64_t seen = 0;
+        for(unsigned int i = 0; i < BUCKETS; ++i)
+        {
+            seen += m_buckets[i];
+            if(seen >= rank)
+                return std::min(lower_bound(i), m_max);
+        }
+        return m_max;
+    }
+
+    std::uint64_t count() const noexcept { return m_count; }
+    std::uint64_t max() const noexcept { return m_max; }
+    double mean() const noexcept { return m_count ? double(m_sum) / m_count : 0.0; }
+
+private:
+    std::vector<std::uint64_t> m_buckets;
+    std::uint64_t m_count = 0;
+    std::uint64_t m_sum = 0;
+    std::uint64_t m_max = 0;
+};
+
+/*
+ * Single writer histogram which other threads may read at any time.
+ * The owner updates with relaxed load + store, never with an RMW.
+ */
+class concurrent_histogram
+{
+public:
+    concurrent_histogram() noexcept
+    {
+        for(auto& b : m_buckets)
+            b.store(0, std::memory_order_relaxed);
+    }
+
+    void record(std::uint64_t value) noexcept
+    {
+        bump(m_buckets[latency_histogram::bucket(value)], 1);
+        bump(m_sum, value);
+        if(value > m_max.load(std::memory_order_relaxed))
+            m_max.store(value, std::memory_order_relaxed);
+    }
+
+    void copy_to(latency_histogram& h) const noexcept
+    {
+        for(unsigned int i = 0; i < latency_histogram::BUCKETS; ++i)
+            if(auto n = m_buckets[i].load(std::memory_order_relaxed))
+                h.add(i, n);
+        h.add_totals(m_sum.load(std::memory_order_relaxed), m_max.load(std::memory_order_relaxed));
+    }
+
+private:
+    static void bump(std::atomic<std::uint64_t>& counter, std::uint64_t n) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::atomic<std::uint64_t> m_buckets[latency_histogram::BUCKETS];
+    std::atomic<std::uint64_t> m_sum = 0;
+    std::atomic<std::uint64_t> m_max = 0;
+};
+
+/*
+ * Per worker slot, owned by one worker thread. Cache line aligned so
+ * neighbouring workers never share a line.
+ */
+struct alignas(64) worker_stats
+{
+    std::atomic<std::uint64_t> completed = 0;
+    std::atomic<std::uint64_t> local_pushes = 0;
+    std::atomic<std::uint64_t> steals = 0;
+    concurrent_histogram queue_wait;
+    concurrent_histogram execution;
+
+    static void bump(std::atomic<std::uint64_t>& counter) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Per queue counters, bumped by every submitter and worker touching the
+ * queue. Their difference is the approximate depth.
+ */
+struct alignas(64) queue_stats
+{
+    alignas(64) std::atomic<std::uint64_t> pushed = 0;
+    alignas(64) std::atomic<std::uint64_t> popped = 0;
+};
+
+/*
+ * Merged snapshot returned by stats(). Times are in nanoseconds.
+ */
+struct thread_pool_stats
+{
+    std::uint64_t submitted = 0;
+    std::uint64_t completed = 0;
+    std::uint64_t steals = 0;
+    std::uint64_t expired = 0;
+    std::vector<std::int64_t> queue_depth;
+    latency_histogram queue_wait;
+    latency_histogram execution;
+};
+
+using stats_clock = std::chrono::steady_clock;
+
+inline std::uint64_t stats_elapsed_ns(stats_clock::time_point from, stats_clock::time_point to) noexcept
+{
+    return to > from ? std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count() : 0;
+}
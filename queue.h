@@ -5,10 +5,13 @@
 #include <atomic>
 #include <chrono>
 #include <utility>
+#include <iterator>
 #include <stdexcept>
 #include <type_traits>
 #include <condition_variable>
 #include "semaphore.h"
+#include "ring_memory.h"
+#include "wait_strategy.h"
 #include <thread>
 #include <fstream>
 #include <string>
@@ -124,6 +127,86 @@ public:
         return true;
     }
 
+    /*
+     * The queue is unbounded, so pushing never waits for room and these
+     * only exist to give every queue the same timed interface.
+     */
+    template<typename U, typename Rep, typename Period>
+    bool push_for(U&& item, const std::chrono::duration<Rep, Period>&)
+    {
+        push(std::forward<U>(item));
+        return true;
+    }
+
+    template<typename U, typename Clock, typename Duration>
+    bool push_until(U&& item, const std::chrono::time_point<Clock, Duration>&)
+    {
+        push(std::forward<U>(item));
+        return true;
+    }
+
+    template<typename Rep, typename Period>
+    bool pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return pop_until(item, std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Clock, typename Duration>
+    bool pop_until(T& item, const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        std::unique_lock lock(m_mutex);
+        if(!m_ready.wait_until(lock, deadline, [this]() { return !m_queue.empty() || m_done; }))
+            return false;
+        if(m_queue.empty())
+            return false;
+        if constexpr(std::is_move_assignable<T>::value)
+            item = std::move(m_queue.front());
+        else
+            item = m_queue.front();
+        m_queue.pop();
+        return true;
+    }
+
+    /*
+     * Moves [first, last) in under a single lock.
+     */
+    template<typename It>
+    unsigned int push_bulk(It first, It last)
+    {
+        unsigned int n = 0;
+        {
+            std::unique_lock lock(m_mutex);
+            for(; first != last; ++first, ++n)
+                m_queue.emplace(std::move(*first));
+        }
+        if(n == 1)
+            m_ready.notify_one();
+        else if(n)
+            m_ready.notify_all();
+        return n;
+    }
+
+    /*
+     * Blocks for the first item, then takes up to max without blocking.
+     * Returns the number of items written to out, 0 once done.
+     */
+    template<typename It>
+    unsigned int pop_bulk(It out, unsigned int max)
+    {
+        if(!max)
+            return 0;
+        std::unique_lock lock(m_mutex);
+        while(m_queue.empty() && !m_done)
+            m_ready.wait(lock);
+        unsigned int n = 0;
+        for(; n < max && !m_queue.empty(); ++n, ++out)
+        {
+            *out = std::move(m_queue.front());
+            m_queue.pop();
+        }
+        return n;
+    }
+
     void done() noexcept
     {
         {
@@ -354,11 +437,11 @@ public:
     template<typename Q = T>
     typename std::enable_if<
         !std::is_move_assignable<Q>::value &&
-        std::is_nothrow_copy_assignable<Q>::value, void>::type
+        std::is_nothrow_copy_assignable<Q>::value, bool>::type
     pop(T& item) noexcept
     {
         if(!m_fullSlots.wait())
-            return;
+            return false;
         {
             std::scoped_lock lock(m_cs);
             item = m_data[m_popIndex];
@@ -367,16 +450,17 @@ public:
             --m_count;
         }
         m_openSlots.post();
+        return true;
     }
 
     template<typename Q = T>
     typename std::enable_if<
         !std::is_move_assignable<Q>::value &&
-        !std::is_nothrow_copy_assignable<Q>::value, void>::type
+        !std::is_nothrow_copy_assignable<Q>::value, bool>::type
     pop(T& item)
     {
         if(!m_fullSlots.wait())
-            return;
+            return false;
         {
             std::scoped_lock lock(m_cs);
             try
@@ -393,16 +477,17 @@ public:
             --m_count;
         }
         m_openSlots.post();
+        return true;
     }
 
     template<typename Q = T>
     typename std::enable_if<
         std::is_move_assignable<Q>::value &&
-        std::is_nothrow_move_assignable<Q>::value, void>::type
+        std::is_nothrow_move_assignable<Q>::value, bool>::type
     pop(T& item) noexcept
     {
         if(!m_fullSlots.wait())
-            return;
+            return false;
         {
             std::scoped_lock lock(m_cs);
             item = std::move(m_data[m_popIndex]);
@@ -411,16 +496,17 @@ public:
             --m_count;
         }
         m_openSlots.post();
+        return true;
     }
 
     template<typename Q = T>
     typename std::enable_if<
         std::is_move_assignable<Q>::value &&
-        !std::is_nothrow_move_assignable<Q>::value, void>::type
+        !std::is_nothrow_move_assignable<Q>::value, bool>::type
     pop(T& item)
     {
         if (!m_fullSlots.wait())
-            return;
+            return false;
         {
             std::scoped_lock lock(m_cs);
             try
@@ -437,6 +523,7 @@ public:
             --m_count;
         }
         m_openSlots.post();
+        return true;
     }
 
     template<typename Q = T>
@@ -535,6 +622,126 @@ public:
         return true;
     }
 
+    template<typename Rep, typename Period>
+    bool push_for(const T& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return emplace_until(std::chrono::steady_clock::now() + timeout, item);
+    }
+
+    template<typename Rep, typename Period>
+    bool push_for(T&& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return emplace_until(std::chrono::steady_clock::now() + timeout, std::move(item));
+    }
+
+    template<typename Clock, typename Duration>
+    bool push_until(const T& item, const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return emplace_until(deadline, item);
+    }
+
+    template<typename Clock, typename Duration>
+    bool push_until(T&& item, const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        return emplace_until(deadline, std::move(item));
+    }
+
+    template<typename Rep, typename Period>
+    bool pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        return pop_until(item, std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Clock, typename Duration>
+    bool pop_until(T& item, const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        if(!m_fullSlots.wait_until(deadline))
+            return false;
+        {
+            std::scoped_lock lock(m_cs);
+            try
+            {
+                if constexpr(std::is_move_assignable<T>::value)
+                    item = std::move(m_data[m_popIndex]);
+                else
+                    item = m_data[m_popIndex];
+            }
+            catch (...)
+            {
+                m_fullSlots.post();
+                throw;
+            }
+            m_data[m_popIndex].~T();
+            m_popIndex = ++m_popIndex % m_size;
+            --m_count;
+        }
+        m_openSlots.post();
+        return true;
+    }
+
+    /*
+     * Blocks for one open slot, then grabs as many more as are free and
+     * fills them under a single lock. Returns the number of items moved in,
+     * which is less than requested only once done.
+     */
+    template<typename It>
+    unsigned int push_bulk(It first, It last) noexcept
+    {
+        static_assert(std::is_nothrow_move_constructible<T>::value, "push_bulk requires nothrow move construction!");
+
+        unsigned int pushed = 0;
+        unsigned int left = static_cast<unsigned int>(std::distance(first, last));
+        while(left)
+        {
+            unsigned int n = m_openSlots.try_wait_many(left);
+            if(!n)
+            {
+                if(!m_openSlots.wait())
+                    break;
+                n = 1 + m_openSlots.try_wait_many(left - 1);
+            }
+            {
+                std::scoped_lock lock(m_cs);
+                for(unsigned int i = 0; i < n; ++i, ++first)
+                {
+                    new (m_data + m_pushIndex) T (std::move(*first));
+                    m_pushIndex = ++m_pushIndex % m_size;
+                }
+                m_count += n;
+            }
+            m_fullSlots.post(n);
+            pushed += n;
+            left -= n;
+        }
+        return pushed;
+    }
+
+    /*
+     * Blocks for the first item, then takes up to max without blocking.
+     * Returns the number of items written to out, 0 once done.
+     */
+    template<typename It>
+    unsigned int pop_bulk(It out, unsigned int max) noexcept
+    {
+        static_assert(std::is_nothrow_move_assignable<T>::value, "pop_bulk requires nothrow move assignment!");
+
+        if(!max || !m_fullSlots.wait())
+            return 0;
+        unsigned int n = 1 + m_fullSlots.try_wait_many(max - 1);
+        {
+            std::scoped_lock lock(m_cs);
+            for(unsigned int i = 0; i < n; ++i, ++out)
+            {
+                *out = std::move(m_data[m_popIndex]);
+                m_data[m_popIndex].~T();
+                m_popIndex = ++m_popIndex % m_size;
+            }
+            m_count -= n;
+        }
+        m_openSlots.post(n);
+        return n;
+    }
+
     bool empty() const noexcept
     {
         std::scoped_lock lock(m_cs);
@@ -565,6 +772,29 @@ public:
     }
 
 private:
+    template<typename Clock, typename Duration, typename U>
+    bool emplace_until(const std::chrono::time_point<Clock, Duration>& deadline, U&& item)
+    {
+        if(!m_openSlots.wait_until(deadline))
+            return false;
+        {
+            std::scoped_lock lock(m_cs);
+            try
+            {
+                new (m_data + m_pushIndex) T (std::forward<U>(item));
+            }
+            catch (...)
+            {
+                m_openSlots.post();
+                throw;
+            }
+            m_pushIndex = ++m_pushIndex % m_size;
+            ++m_count;
+        }
+        m_fullSlots.post();
+        return true;
+    }
+
     const unsigned int m_size;
     unsigned int m_pushIndex;
     unsigned int m_popIndex;
@@ -576,36 +806,42 @@ private:
     mutable std::mutex m_cs;
 };
 
+/*
+ * Q_SIZE is the default capacity, see ring_memory.h. W is how a thread
+ * waits for its turn to publish, see wait_strategy.h.
+ */
 template<typename T,
-         unsigned long Q_SIZE = 4096ul>
+         unsigned long Q_SIZE = 4096ul,
+         typename W = yield_wait>
 class atomic_blocking_queue_impl
 {
 public:
-    static constexpr unsigned long Q_MASK = Q_SIZE - 1;
-
-    explicit atomic_blocking_queue_impl()
+    explicit atomic_blocking_queue_impl(unsigned long capacity = Q_SIZE,
+                                        const ring_options& options = ring_options())
     :
       m_pushIndex(0),
       m_popIndex(0),
       m_pushingIndex(0),
       m_popingIndex(0),
-      m_data(
-          reinterpret_cast<T*>(
-              ::operator new(sizeof(T) * Q_SIZE,
-                             std::align_val_t(4096))))
+      m_size(ring_capacity(capacity)),
+      m_mask(m_size - 1),
+      m_memory(sizeof(T) * m_size, options),
+      m_data(static_cast<T*>(m_memory.data()))
     {
-        if(!Q_SIZE)
-            throw std::invalid_argument("Invalid queue size!");
     }
 
     ~atomic_blocking_queue_impl() noexcept
     {
-        while (m_popIndex & Q_MASK != m_pushIndex & Q_MASK)
+        while (m_popIndex != m_pushIndex)
         {
-            m_data[m_popIndex & Q_MASK].~T();
-            m_popIndex++;
+            m_data[m_popIndex & m_mask].~T();
+            m_popIndex = m_popIndex + 1;
         }
-        ::operator delete(m_data);
+    }
+
+    unsigned long capacity() const noexcept
+    {
+        return m_size;
     }
 
     template<typename Q = T>
@@ -616,13 +852,35 @@ public:
     {
         const auto expected = m_pushingIndex.fetch_add(1);
 
-        new (m_data + (expected & Q_MASK)) T (std::forward<T>(item));
+        new (m_data + (expected & m_mask)) T (std::forward<T>(item));
+
+        W w;
+        while (expected != m_pushIndex)
+        {
+            w.pause();
+        }
+        m_pushIndex = expected + 1;
+    }
+
+    /*
+     * Reserves one contiguous range for [first, last) with a single
+     * fetch_add. The caller guarantees there is room for all of it.
+     */
+    template<typename It>
+    void push_bulk(It first, It last) noexcept
+    {
+        const auto n = static_cast<unsigned int>(std::distance(first, last));
+        const auto expected = m_pushingIndex.fetch_add(n);
+
+        for(unsigned int i = 0; i < n; ++i, ++first)
+            new (m_data + ((expected + i) & m_mask)) T (std::move(*first));
 
+        W w;
         while (expected != m_pushIndex)
         {
-            std::this_thread::yield();
+            w.pause();
         }
-        m_pushIndex++;
+        m_pushIndex = expected + n;
     }
 
     template<typename Q = T>
@@ -633,14 +891,47 @@ public:
     {
         const auto expected = m_popingIndex.fetch_add(1);
 
-        item = std::move(m_data[expected & Q_MASK]);
-        m_data[expected & Q_MASK].~T();
+        item = std::move(m_data[expected & m_mask]);
+        m_data[expected & m_mask].~T();
+
+        W w;
+        while (expected != m_popIndex)
+        {
+            w.pause();
+        }
+        m_popIndex = expected + 1;
+    }
+
+    /*
+     * Takes exactly n items with a single fetch_add. The caller guarantees
+     * that many are available.
+     */
+    template<typename It>
+    void pop_bulk(It out, unsigned int n) noexcept
+    {
+        const auto expected = m_popingIndex.fetch_add(n);
+
+        for(unsigned int i = 0; i < n; ++i, ++out)
+        {
+            *out = std::move(m_data[(expected + i) & m_mask]);
+            m_data[(expected + i) & m_mask].~T();
+        }
 
+        W w;
         while (expected != m_popIndex)
         {
-            std::this_thread::yield();
+            w.pause();
         }
-        m_popIndex++;
+        m_popIndex = expected + n;
+    }
+
+    /*
+     * Writes one byte per page of the still empty ring so its pages get
+     * placed now, by the calling thread, and not by the first push.
+     */
+    void prefault() noexcept
+    {
+        m_memory.prefault();
     }
 
 private:
@@ -650,24 +941,45 @@ private:
     alignas(64) std::atomic_uint m_pushingIndex;
     alignas(64) std::atomic_uint m_popingIndex;
 
+    const unsigned long m_size;
+    const unsigned long m_mask;
+    ring_memory m_memory;
     T* m_data;
 };
 
+/*
+ * Takes its capacity from Q, which picks it at construction.
+ */
 template<
         typename T,
         typename Q = atomic_blocking_queue_impl<T, 4096ul>,
-        typename S = fast_semaphore,
-        unsigned long Q_SIZE = 4096ul>
+        typename S = fast_semaphore>
 class atomic_blocking_queue
 {
 public:
     explicit atomic_blocking_queue()
     :
-      m_openSlots(Q_SIZE),
+      m_openSlots(static_cast<int>(queue_impl.capacity())),
       m_fullSlots(0)
     {
-        if(!Q_SIZE)
-            throw std::invalid_argument("Invalid queue size!");
+    }
+
+    /*
+     * Forwards its arguments to the Q constructor, e.g. the capacity of a
+     * ring or the producer and consumer counts of a LockFreeQueue.
+     */
+    template<typename A, typename... Args>
+    explicit atomic_blocking_queue(A&& a, Args&&... args)
+    :
+      queue_impl(std::forward<A>(a), std::forward<Args>(args)...),
+      m_openSlots(static_cast<int>(queue_impl.capacity())),
+      m_fullSlots(0)
+    {
+    }
+
+    unsigned long capacity() const noexcept
+    {
+        return queue_impl.capacity();
     }
 
     ~atomic_blocking_queue() noexcept  {}
@@ -739,6 +1051,118 @@ public:
         return true;
     }
 
+    template<typename Rep, typename Period>
+    bool push_for(T&& item, const std::chrono::duration<Rep, Period>& timeout) noexcept
+    {
+        if(!m_openSlots.wait_for(timeout))
+        {
+            return false;
+        }
+
+        queue_impl.push(std::forward<T>(item));
+
+        m_fullSlots.post();
+        return true;
+    }
+
+    template<typename Clock, typename Duration>
+    bool push_until(T&& item, const std::chrono::time_point<Clock, Duration>& deadline) noexcept
+    {
+        if(!m_openSlots.wait_until(deadline))
+        {
+            return false;
+        }
+
+        queue_impl.push(std::forward<T>(item));
+
+        m_fullSlots.post();
+        return true;
+    }
+
+    template<typename Rep, typename Period>
+    bool pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout) noexcept
+    {
+        if(!m_fullSlots.wait_for(timeout))
+        {
+            return false;
+        }
+
+        queue_impl.pop(item);
+
+        m_openSlots.post();
+        return true;
+    }
+
+    template<typename Clock, typename Duration>
+    bool pop_until(T& item, const std::chrono::time_point<Clock, Duration>& deadline) noexcept
+    {
+        if(!m_fullSlots.wait_until(deadline))
+        {
+            return false;
+        }
+
+        queue_impl.pop(item);
+
+        m_openSlots.post();
+        return true;
+    }
+
+    /*
+     * Blocks for one open slot, then grabs as many more as are free and hands
+     * them to the implementation as one range, posting the consumers once.
+     * Returns the number of items moved in, which is less than requested
+     * only once done.
+     */
+    template<typename It>
+    unsigned int push_bulk(It first, It last) noexcept
+    {
+        unsigned int pushed = 0;
+        unsigned int left = static_cast<unsigned int>(std::distance(first, last));
+        while(left)
+        {
+            unsigned int n = m_openSlots.try_wait_many(left);
+            if(!n)
+            {
+                if(!m_openSlots.wait())
+                    break;
+                n = 1 + m_openSlots.try_wait_many(left - 1);
+            }
+
+            auto next = std::next(first, n);
+            queue_impl.push_bulk(first, next);
+            first = next;
+
+            m_fullSlots.post(n);
+            pushed += n;
+            left -= n;
+        }
+        return pushed;
+    }
+
+    /*
+     * Blocks for the first item, then takes up to max without blocking.
+     * Returns the number of items written to out, 0 once done.
+     */
+    template<typename It>
+    unsigned int pop_bulk(It out, unsigned int max) noexcept
+    {
+        if(!max || !m_fullSlots.wait())
+            return 0;
+
+        unsigned int n = 1 + m_fullSlots.try_wait_many(max - 1);
+
+        queue_impl.pop_bulk(out, n);
+
+        m_openSlots.post(n);
+        return n;
+    }
+
+    template<typename I = Q>
+    auto prefault() noexcept -> decltype(std::declval<I&>().prefault())
+    {
+        queue_impl.prefault();
+    }
+
     void done() noexcept
     {
         m_done = true;
@@ -24,139 +24,302 @@
 #include <stdlib.h>
 #include <cassert>
 #include <cstring>
+#include <stdexcept>
 #include <atomic>
 #include <immintrin.h>
 #include <limits.h>
 #include <new>
+#include <mutex>
+#include <memory>
+#include <vector>
 #include <algorithm>
+#include <iterator>
+#include "ring_memory.h"
+#include "wait_strategy.h"
 
-static thread_local size_t  __thr_id;
-
-/**
- * @return continous thread IDs starting from 0 as opposed to pthread_self().
+/*
+ * Threads take part through tokens: register_producer() and
+ * register_consumer() hand out a slot of the queue's producer or consumer
+ * table, and dropping the token frees it for the next thread. The min scans
+ * only visit the slots below the highest one in use. push() and pop()
+ * without a token register the calling thread on first use and keep the
+ * token until the thread exits. A table which is full grows by another
+ * chunk, twice the size of the last one, so any number of threads may use
+ * the queue; chunks never move and are only freed with the queue.
+ *
+ * Q_SIZE is the default capacity, see ring_memory.h. W is how a thread
+ * waits for the slowest thread of the other side, see wait_strategy.h.
  */
-inline size_t
-thr_id()
-{
-    return __thr_id;
-}
-
-inline void
-set_thr_id(size_t id)
-{
-    __thr_id = id;
-}
-
 template<class T,
-        unsigned long Q_SIZE = 4096>
+        unsigned long Q_SIZE = 4096,
+        class W = yield_wait>
 class LockFreeQueue {
 private:
-    static constexpr unsigned long Q_MASK = Q_SIZE - 1;
+    /*
+     * The position a producer (consumer) works on, ULONG_MAX while idle.
+     * One cache line each, neighbours write theirs all the time.
+     */
+    struct alignas(64) ThrPos
+    {
+        std::atomic<unsigned long> pos = ULONG_MAX;
+        bool used = false;
+    };
+
+    /*
+     * One slot table: chunk k holds base << k slots and starts at slot
+     * base * (2^k - 1). A chunk is published before the active bound
+     * first reaches into it, so a scan which read the bound finds it.
+     */
+    struct Table
+    {
+        static constexpr unsigned int CHUNKS = 32;
+
+        explicit Table(size_t n)
+            :
+            base(n)
+        {
+        }
+
+        Table(const Table&) = delete;
+        Table& operator=(const Table&) = delete;
+
+        ~Table()
+        {
+            for (auto& chunk : chunks)
+                delete[] chunk.load(std::memory_order_relaxed);
+        }
+
+        size_t
+        first(unsigned int k) const noexcept
+        {
+            return base * ((size_t(1) << k) - 1);
+        }
+
+        /*
+         * Slot i, which must lie below the active bound.
+         */
+        ThrPos&
+        operator[](size_t i) const noexcept
+        {
+            const auto k = static_cast<unsigned int>(63 - __builtin_clzll(i / base + 1));
+            return chunks[k].load(std::memory_order_acquire)[i - first(k)];
+        }
 
-    struct ThrPos
+        const size_t base;
+        std::atomic<ThrPos*> chunks[CHUNKS] = {};
+        // One past the highest slot in use.
+        std::atomic<size_t> active = 0;
+    };
+
+    /*
+     * Both slot tables. Shared with the tokens, which may outlive the queue.
+     */
+    struct Registry
     {
-        unsigned long head, tail;
+        Registry(size_t n_producers, size_t n_consumers)
+            :
+            tables{ Table(n_producers), Table(n_consumers) }
+        {
+        }
+
+        std::mutex mutex;
+        Table tables[2];
+        std::atomic_bool alive = true;
     };
 
+    enum { PRODUCERS, CONSUMERS };
+
 public:
-    LockFreeQueue(size_t n_producers = 1, size_t n_consumers = 2)
+    template<bool Producer>
+    class token
+    {
+    public:
+        token() noexcept = default;
+
+        token(token&& other) noexcept
+            :
+            registry_(std::move(other.registry_)),
+            slot_(other.slot_),
+            pos_(other.pos_)
+        {
+        }
+
+        token& operator=(token&& other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                registry_ = std::move(other.registry_);
+                slot_ = other.slot_;
+                pos_ = other.pos_;
+            }
+            return *this;
+        }
+
+        ~token()
+        {
+            release();
+        }
+
+        explicit operator bool() const noexcept
+        {
+            return registry_ != nullptr;
+        }
+
+    private:
+        friend class LockFreeQueue;
+        static constexpr int TABLE = Producer ? PRODUCERS : CONSUMERS;
+
+        token(std::shared_ptr<Registry> registry, size_t slot) noexcept
+            :
+            registry_(std::move(registry)),
+            slot_(slot),
+            pos_(&registry_->tables[TABLE][slot])
+        {
+        }
+
+        ThrPos&
+        pos() const noexcept
+        {
+            return *pos_;
+        }
+
+        void
+        release() noexcept
+        {
+            if (!registry_)
+                return;
+
+            // Ours may be the last reference, keep it past the unlock.
+            const auto registry = std::move(registry_);
+            std::scoped_lock lock(registry->mutex);
+            auto& table = registry->tables[TABLE];
+            pos_->pos.store(ULONG_MAX, std::memory_order_relaxed);
+            pos_->used = false;
+
+            auto n = table.active.load(std::memory_order_relaxed);
+            while (n && !table[n - 1].used)
+                --n;
+            table.active.store(n);
+        }
+
+        std::shared_ptr<Registry> registry_;
+        size_t slot_ = 0;
+        ThrPos* pos_ = nullptr;
+    };
+
+    using producer_token = token<true>;
+    using consumer_token = token<false>;
+
+    /*
+     * n_producers and n_consumers size the first chunk of either slot
+     * table; more threads at a time grow it.
+     */
+    LockFreeQueue(size_t n_producers = 64, size_t n_consumers = 64,
+                  unsigned long capacity = Q_SIZE,
+                  const ring_options& options = ring_options())
         :
-        n_producers_(n_producers),
-        n_consumers_(n_consumers),
+        registry_(std::make_shared<Registry>(n_producers, n_consumers)),
         head_(0),
         tail_(0),
         last_head_(0),
-        last_tail_(0)
+        last_tail_(0),
+        size_(ring_capacity(capacity)),
+        mask_(size_ - 1),
+        memory_(sizeof(T) * size_, options),
+        ptr_array_(static_cast<T*>(memory_.data()))
     {
-        auto n = std::max(n_consumers_, n_producers_);
-        thr_p_ = reinterpret_cast<ThrPos*>(
-                    ::operator new(
-                        sizeof(ThrPos) * n,
-                        std::align_val_t(4096)));
+        if (!n_producers || !n_consumers)
+            throw std::invalid_argument("Invalid LockFreeQueue slot count!");
+    }
 
-        // Set per thread tail and head to ULONG_MAX.
-        std::memset((void *)thr_p_, 0xFF, sizeof(ThrPos) * n);
+    ~LockFreeQueue()
+    {
+        registry_->alive = false;
+        for (auto tail = tail_.load(); tail != head_.load(); ++tail)
+            ptr_array_[tail & mask_].~T();
+    }
 
-        ptr_array_ = reinterpret_cast<T*>(
-                        ::operator new(
-                            sizeof(T) * Q_SIZE,
-                            std::align_val_t(4096)));
+    unsigned long
+    capacity() const noexcept
+    {
+        return size_;
     }
 
-    ~LockFreeQueue()
+    producer_token
+    register_producer()
     {
-        ::operator delete(ptr_array_);
-        ::operator delete(thr_p_);
+        return producer_token(registry_, claim(PRODUCERS));
     }
 
-    ThrPos&
-    thr_pos() const
+    consumer_token
+    register_consumer()
     {
-        assert(thr_id() < std::max(n_consumers_, n_producers_));
-        return thr_p_[thr_id()];
+        return consumer_token(registry_, claim(CONSUMERS));
     }
 
     void
     push(T&& t)
     {
-        ThrPos& tp = thr_pos();
+        push(local(t_producers), std::forward<T>(t));
+    }
+
+    void
+    push(producer_token& token, T&& t)
+    {
+        ThrPos& tp = token.pos();
         /*
          * Request next place to push.
          *
          * Second assignemnt is atomic only for head shift, so there is
-         * a time window in which thr_p_[tid].head = ULONG_MAX, and
+         * a time window in which tp.pos = ULONG_MAX, and
          * head could be shifted significantly by other threads,
          * so pop() will set last_head_ to head.
-         * After that thr_p_[tid].head is setted to old head value
+         * After that tp.pos is setted to old head value
          * (which is stored in local CPU register) and written by @ptr.
          *
          * First assignment guaranties that pop() sees values for
-         * head and thr_p_[tid].head not greater that they will be
+         * head and tp.pos not greater that they will be
          * after the second assignment with head shift.
          *
          * Loads and stores are not reordered with locked instructions,
          * so we don't need a memory barrier here.
          */
-        tp.head = head_;
-        tp.head = head_.fetch_add(1);
+        tp.pos.store(head_, std::memory_order_relaxed);
+        const auto head = head_.fetch_add(1);
+        tp.pos.store(head, std::memory_order_relaxed);
 
         /*
          * We do not know when a consumer uses the pop()'ed pointer,
          * so we can not overwrite it and have to wait the lowest tail.
          */
-        while (tp.head >= last_tail_ + Q_SIZE)
+        W w;
+        while (head >= last_tail() + size_)
         {
-            auto min = tail_.load();
-
-            // Update the last_tail_.
-            for (size_t i = 0; i < n_consumers_; ++i)
-            {
-                const auto tmp_t = thr_p_[i].tail;
-
-                // Force compiler to use tmp_h exactly once.
-                //asm volatile("" ::: "memory");
+            const auto min = lowest(CONSUMERS, tail_.load());
+            last_tail_.store(min, std::memory_order_release);
 
-                if (tmp_t < min)
-                    min = tmp_t;
-            }
-            last_tail_ = min;
-
-            if (tp.head < last_tail_ + Q_SIZE)
+            if (head < min + size_)
                 break;
-            //_mm_pause();
-            std::this_thread::yield();
+            w.pause();
         }
 
-        new (ptr_array_ + (tp.head & Q_MASK)) T (std::forward<T>(t));
+        new (ptr_array_ + (head & mask_)) T (std::forward<T>(t));
 
         // Allow consumers eat the item.
-        tp.head = ULONG_MAX;
+        tp.pos.store(ULONG_MAX, std::memory_order_release);
     }
 
     void
     pop(T& t)
     {
-        ThrPos& tp = thr_pos();
+        pop(local(t_consumers), t);
+    }
+
+    void
+    pop(consumer_token& token, T& t)
+    {
+        ThrPos& tp = token.pos();
         /*
          * Request next place from which to pop.
          * See comments for push().
@@ -164,8 +327,9 @@ public:
          * Loads and stores are not reordered with locked instructions,
          * so we don't need a memory barrier here.
          */
-        tp.tail = tail_.load();
-        tp.tail = tail_.fetch_add(1);
+        tp.pos.store(tail_.load(), std::memory_order_relaxed);
+        const auto tail = tail_.fetch_add(1);
+        tp.pos.store(tail, std::memory_order_relaxed);
 
         /*
          * tid'th place in ptr_array_ is reserved by the thread -
@@ -174,52 +338,234 @@ public:
          * last_head_ guaraties that no any consumer eats the item
          * before producer reserved the position writes to it.
          */
-        while (tp.tail >= last_head_)
+        W w;
+        while (tail >= last_head())
         {
-            auto min = head_.load();
+            const auto min = lowest(PRODUCERS, head_.load());
+            last_head_.store(min, std::memory_order_release);
 
-            // Update the last_head_.
-            for (size_t i = 0; i < n_producers_; ++i)
-            {
-                auto tmp_h = thr_p_[i].head;
+            if (tail < min)
+                break;
+            w.pause();
+        }
 
-                // Force compiler to use tmp_h exactly once.
-                //asm volatile("" ::: "memory");
+        t.swap(ptr_array_[tail & mask_]);
+        ptr_array_[tail & mask_].~T();
 
-                if (tmp_h < min)
-                    min = tmp_h;
-            }
-            last_head_ = min;
+        // Allow producers rewrite the slot.
+        tp.pos.store(ULONG_MAX, std::memory_order_release);
+    }
+
+    template<typename It>
+    void
+    push_bulk(It first, It last)
+    {
+        push_bulk(local(t_producers), first, last);
+    }
+
+    /*
+     * Same protocol as push(), but reserves the whole range [first, last)
+     * with a single fetch_add. tp.pos holds the start of the range, which
+     * keeps every reserved slot out of reach of the consumers until done.
+     */
+    template<typename It>
+    void
+    push_bulk(producer_token& token, It first, It last)
+    {
+        ThrPos& tp = token.pos();
+        const auto n = static_cast<unsigned long>(std::distance(first, last));
+        assert(n <= size_);
+        if (!n)
+            return;
+
+        tp.pos.store(head_, std::memory_order_relaxed);
+        const auto head = head_.fetch_add(n);
+        tp.pos.store(head, std::memory_order_relaxed);
+
+        W w;
+        while (head + n - 1 >= last_tail() + size_)
+        {
+            const auto min = lowest(CONSUMERS, tail_.load());
+            last_tail_.store(min, std::memory_order_release);
 
-            if (tp.tail < last_head_)
+            if (head + n - 1 < min + size_)
                 break;
-            //_mm_pause();
-            std::this_thread::yield();
+            w.pause();
         }
 
-        t.swap(ptr_array_[tp.tail & Q_MASK]);
-        ptr_array_[tp.tail & Q_MASK].~T();
+        for (unsigned long i = 0; i < n; ++i, ++first)
+            new (ptr_array_ + ((head + i) & mask_)) T (std::move(*first));
 
-        // Allow producers rewrite the slot.
-        tp.tail = ULONG_MAX;
+        tp.pos.store(ULONG_MAX, std::memory_order_release);
+    }
+
+    template<typename It>
+    void
+    pop_bulk(It out, unsigned long n)
+    {
+        pop_bulk(local(t_consumers), out, n);
+    }
+
+    /*
+     * Same protocol as pop(), but takes n items with a single fetch_add.
+     */
+    template<typename It>
+    void
+    pop_bulk(consumer_token& token, It out, unsigned long n)
+    {
+        ThrPos& tp = token.pos();
+        assert(n <= size_);
+        if (!n)
+            return;
+
+        tp.pos.store(tail_.load(), std::memory_order_relaxed);
+        const auto tail = tail_.fetch_add(n);
+        tp.pos.store(tail, std::memory_order_relaxed);
+
+        W w;
+        while (tail + n - 1 >= last_head())
+        {
+            const auto min = lowest(PRODUCERS, head_.load());
+            last_head_.store(min, std::memory_order_release);
+
+            if (tail + n - 1 < min)
+                break;
+            w.pause();
+        }
+
+        using std::swap;
+        for (unsigned long i = 0; i < n; ++i, ++out)
+        {
+            swap(*out, ptr_array_[(tail + i) & mask_]);
+            ptr_array_[(tail + i) & mask_].~T();
+        }
+
+        tp.pos.store(ULONG_MAX, std::memory_order_release);
+    }
+
+    /*
+     * Writes one byte per page of the still empty ring so its pages get
+     * placed now, by the calling thread, and not by the first push.
+     */
+    void
+    prefault() noexcept
+    {
+        memory_.prefault();
     }
 
 private:
+    /*
+     * Plain loads on x86 like the volatiles they replace, but acquire: a
+     * bound published by another thread carries the slot hand-off with it.
+     */
+    unsigned long
+    last_head() const noexcept
+    {
+        return last_head_.load(std::memory_order_acquire);
+    }
+
+    unsigned long
+    last_tail() const noexcept
+    {
+        return last_tail_.load(std::memory_order_acquire);
+    }
+
+    /*
+     * The lowest position any active slot of a table works on, min if none.
+     * Read after the shared index, so a thread which registered before
+     * moving that index is always among the slots visited.
+     */
+    unsigned long
+    lowest(int table, unsigned long min) const noexcept
+    {
+        const auto& t = registry_->tables[table];
+        const auto n = t.active.load();
+        for (size_t i = 0, k = 0; i < n; ++k)
+        {
+            const ThrPos* slots = t.chunks[k].load(std::memory_order_acquire);
+            const auto m = std::min(t.base << k, n - i);
+            for (size_t j = 0; j < m; ++j)
+            {
+                const auto pos = slots[j].pos.load(std::memory_order_acquire);
+                if (pos < min)
+                    min = pos;
+            }
+            i += m;
+        }
+        return min;
+    }
+
+    /*
+     * Lowest free slot of a table, adding a chunk if all are taken.
+     */
+    size_t
+    claim(int table)
+    {
+        std::scoped_lock lock(registry_->mutex);
+        auto& t = registry_->tables[table];
+        for (unsigned int k = 0; k < Table::CHUNKS; ++k)
+        {
+            auto slots = t.chunks[k].load(std::memory_order_relaxed);
+            if (!slots)
+            {
+                slots = new ThrPos[t.base << k];
+                t.chunks[k].store(slots, std::memory_order_release);
+            }
+            for (size_t j = 0; j < (t.base << k); ++j)
+                if (!slots[j].used)
+                {
+                    slots[j].used = true;
+                    const auto i = t.first(k) + j;
+                    if (t.active.load(std::memory_order_relaxed) <= i)
+                        t.active.store(i + 1);
+                    return i;
+                }
+        }
+        throw std::length_error("Too many LockFreeQueue threads!");
+    }
+
+    /*
+     * The calling thread's token for this queue, registered on first use.
+     * Tokens of queues which are gone are dropped on the way.
+     */
+    template<typename Token>
+    Token&
+    local(std::vector<Token>& tokens)
+    {
+        for (auto& t : tokens)
+            if (t.registry_ == registry_)
+                return t;
+
+        tokens.erase(std::remove_if(tokens.begin(), tokens.end(),
+                                    [](const Token& t) { return !t.registry_->alive; }),
+                     tokens.end());
+        if constexpr (Token::TABLE == PRODUCERS)
+            tokens.push_back(register_producer());
+        else
+            tokens.push_back(register_consumer());
+        return tokens.back();
+    }
+
+    inline static thread_local std::vector<producer_token> t_producers;
+    inline static thread_local std::vector<consumer_token> t_consumers;
+
     /*
      * The most hot members are cacheline aligned to avoid
      * False Sharing.
      */
 
-    const size_t n_producers_, n_consumers_;
+    std::shared_ptr<Registry> registry_;
     // currently free position (next to insert)
     std::atomic<unsigned long>  head_ alignas (64);
     // current tail, next to pop
     std::atomic<unsigned long>  tail_ alignas (64);
     // last not-processed producer's pointer
-    volatile unsigned long  last_head_ alignas (64);
+    std::atomic<unsigned long>  last_head_ alignas (64);
     // last not-processed consumer's pointer
-    volatile unsigned long  last_tail_ alignas (64);
-    ThrPos* thr_p_;
+    std::atomic<unsigned long>  last_tail_ alignas (64);
+
+    const unsigned long size_ alignas (64);
+    const unsigned long mask_;
+    ring_memory memory_;
     T*      ptr_array_;
 };
-
@@ -0,0 +1,369 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <boost/program_options.hpp>
+
+#include "queue.h"
+#include "queue2.h"
+#include "mpmc_ring.h"
+#include "segmented_queue.h"
+#include "spsc_ring.h"
+
+/*
+ * Queue microbenchmark.
+ *
+ * Every run moves `ops` items from P producers to C consumers through one
+ * queue. Producers stamp each item right before push(), consumers compute
+ * the push-to-pop latency right after pop(). One line per run is written,
+ * either as CSV (with a header) or as JSON lines.
+ */
+
+namespace po = boost::program_options;
+
+using bench_clock = std::chrono::steady_clock;
+
+static std::int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                bench_clock::now().time_since_epoch()).count();
+}
+
+template<unsigned long N>
+struct payload
+{
+    static_assert(N > sizeof(std::int64_t), "payload too small for the stamp!");
+
+    std::int64_t stamp = 0;
+    char data[N - sizeof(std::int64_t)];
+
+    // LockFreeQueue::pop() swaps the item out of its slot.
+    void swap(payload& other) noexcept
+    {
+        std::swap(*this, other);
+    }
+};
+
+struct result
+{
+    std::string queue;
+    unsigned long payload;
+    unsigned long capacity;
+    unsigned int producers;
+    unsigned int consumers;
+    unsigned long ops;
+    double seconds;
+    std::int64_t p50;
+    std::int64_t p99;
+    std::int64_t p999;
+};
+
+template<typename T, typename Make>
+result run(const std::string& name, unsigned long capacity,
+           unsigned int producers, unsigned int consumers,
+           unsigned long ops, Make make_queue)
+{
+    auto queue = make_queue(producers, consumers);
+
+    std::atomic_bool go = false;
+    std::vector<std::vector<std::int64_t>> latencies(consumers);
+    std::vector<std::thread> threads;
+
+    for(unsigned int i = 0; i < producers; ++i)
+        threads.emplace_back([&, i]()
+        {
+            const auto quota = ops / producers + (i < ops % producers);
+            while(!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            for(unsigned long k = 0; k < quota; ++k)
+            {
+                T item;
+                item.stamp = now_ns();
+                queue->push(std::move(item));
+            }
+        });
+
+    for(unsigned int i = 0; i < consumers; ++i)
+        threads.emplace_back([&, i]()
+        {
+            const auto quota = ops / consumers + (i < ops % consumers);
+            auto& lat = latencies[i];
+            lat.reserve(quota);
+            while(!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            for(unsigned long k = 0; k < quota; ++k)
+            {
+                T item;
+                queue->pop(item);
+                lat.push_back(now_ns() - item.stamp);
+            }
+        });
+
+    auto start = bench_clock::now();
+    go.store(true, std::memory_order_release);
+    for(auto& thread : threads)
+        thread.join();
+    auto stop = bench_clock::now();
+
+    std::vector<std::int64_t> all;
+    all.reserve(ops);
+    for(auto& lat : latencies)
+        all.insert(all.end(), lat.begin(), lat.end());
+    std::sort(all.begin(), all.end());
+
+    auto percentile = [&all](double p) -> std::int64_t
+    {
+        if(all.empty())
+            return 0;
+        auto index = static_cast<size_t>(p * (all.size() - 1));
+        return all[index];
+    };
+
+    result r;
+    r.queue = name;
+    r.payload = sizeof(T);
+    r.capacity = capacity;
+    r.producers = producers;
+    r.consumers = consumers;
+    r.ops = ops;
+    r.seconds = std::chrono::duration<double>(stop - start).count();
+    r.p50 = percentile(0.50);
+    r.p99 = percentile(0.99);
+    r.p999 = percentile(0.999);
+    return r;
+}
+
+struct options
+{
+    std::vector<unsigned int> producers;
+    std::vector<unsigned int> consumers;
+    std::vector<unsigned long> payloads;
+    std::vector<unsigned long> capacities;
+    std::vector<std::string> queues;
+    unsigned long ops;
+    bool json;
+
+    template<typename C, typename V>
+    static bool has(const C& c, const V& v)
+    {
+        return std::find(c.begin(), c.end(), v) != c.end();
+    }
+};
+
+static void report(const result& r, bool json)
+{
+    const auto ops_per_sec = static_cast<unsigned long>(r.seconds > 0 ? r.ops / r.seconds : 0.0);
+    if(json)
+    {
+        std::cout << "{\"queue\":\"" << r.queue << "\""
+                  << ",\"payload\":" << r.payload
+                  << ",\"capacity\":" << r.capacity
+                  << ",\"producers\":" << r.producers
+                  << ",\"consumers\":" << r.consumers
+                  << ",\"ops\":" << r.ops
+                  << ",\"seconds\":" << r.seconds
+                  << ",\"ops_per_sec\":" << ops_per_sec
+                  << ",\"p50_ns\":" << r.p50
+                  << ",\"p99_ns\":" << r.p99
+                  << ",\"p999_ns\":" << r.p999 << "}" << std::endl;
+    }
+    else
+    {
+        std::cout << r.queue << ','
+                  << r.payload << ','
+                  << r.capacity << ','
+                  << r.producers << ','
+                  << r.consumers << ','
+                  << r.ops << ','
+                  << r.seconds << ','
+                  << ops_per_sec << ','
+                  << r.p50 << ','
+                  << r.p99 << ','
+                  << r.p999 << std::endl;
+    }
+}
+
+template<typename T>
+void sweep_capacity(const options& opt, unsigned long C)
+{
+    for(auto p : opt.producers)
+        for(auto c : opt.consumers)
+        {
+            if(options::has(opt.queues, "fixed_semaphore"))
+                report(run<T>("fixed_semaphore", C, p, c, opt.ops, [C](auto, auto)
+                {
+                    return std::make_unique<fixed_blocking_queue<T, semaphore>>(C);
+                }), opt.json);
+
+            if(options::has(opt.queues, "fixed_fast_semaphore"))
+                report(run<T>("fixed_fast_semaphore", C, p, c, opt.ops, [C](auto, auto)
+                {
+                    return std::make_unique<fixed_blocking_queue<T, fast_semaphore>>(C);
+                }), opt.json);
+
+#ifdef __linux__
+            if(options::has(opt.queues, "fixed_futex_semaphore"))
+                report(run<T>("fixed_futex_semaphore", C, p, c, opt.ops, [C](auto, auto)
+                {
+                    return std::make_unique<fixed_blocking_queue<T, futex_semaphore>>(C);
+                }), opt.json);
+
+            if(options::has(opt.queues, "atomic_futex"))
+                report(run<T>("atomic_futex", ring_capacity(C), p, c, opt.ops, [C](auto, auto)
+                {
+                    return std::make_unique<atomic_blocking_queue<T, atomic_blocking_queue_impl<T>, futex_semaphore>>(C);
+                }), opt.json);
+#endif
+
+            if(options::has(opt.queues, "atomic"))
+                report(run<T>("atomic", ring_capacity(C), p, c, opt.ops, [C](auto, auto)
+                {
+                    return std::make_unique<atomic_blocking_queue<T, atomic_blocking_queue_impl<T>, fast_semaphore>>(C);
+                }), opt.json);
+
+            if(options::has(opt.queues, "mpmc"))
+                report(run<T>("mpmc", ring_capacity(C), p, c, opt.ops, [C](auto, auto)
+                {
+                    return std::make_unique<atomic_blocking_queue<T, mpmc_ring<T>, fast_semaphore>>(C);
+                }), opt.json);
+
+            if(options::has(opt.queues, "lockfree"))
+                report(run<T>("lockfree", ring_capacity(C), p, c, opt.ops, [C](auto producers, auto consumers)
+                {
+                    return std::make_unique<atomic_blocking_queue<T, LockFreeQueue<T>, fast_semaphore>>(producers, consumers, C);
+                }), opt.json);
+
+            // Single producer single consumer only.
+            if(options::has(opt.queues, "spsc") && p == 1 && c == 1)
+                report(run<T>("spsc", ring_capacity(C), p, c, opt.ops, [C](auto, auto)
+                {
+                    return std::make_unique<atomic_blocking_queue<T, spsc_ring<T>, fast_semaphore>>(C);
+                }), opt.json);
+        }
+}
+
+template<unsigned long N>
+void sweep_payload(const options& opt)
+{
+    using T = payload<N>;
+
+    if(!options::has(opt.payloads, sizeof(T)))
+        return;
+
+    // Unbounded, capacity does not apply.
+    if(options::has(opt.queues, "blocking"))
+        for(auto p : opt.producers)
+            for(auto c : opt.consumers)
+                report(run<T>("blocking", 0, p, c, opt.ops, [](auto, auto)
+                {
+                    return std::make_unique<blocking_queue<T>>();
+                }), opt.json);
+
+    if(options::has(opt.queues, "segmented"))
+        for(auto p : opt.producers)
+            for(auto c : opt.consumers)
+                report(run<T>("segmented", 0, p, c, opt.ops, [](auto, auto)
+                {
+                    return std::make_unique<segmented_queue<T>>();
+                }), opt.json);
+
+    for(auto capacity : opt.capacities)
+        sweep_capacity<T>(opt, capacity);
+}
+
+static std::vector<unsigned int> powers_up_to(unsigned int max)
+{
+    std::vector<unsigned int> result;
+    for(unsigned int n = 1; n < max; n *= 2)
+        result.push_back(n);
+    result.push_back(max);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    const auto hw = std::max(2u, std::thread::hardware_concurrency());
+
+    unsigned int max_producers;
+    unsigned int max_consumers;
+    options opt;
+
+    po::options_description desc("Queue microbenchmark options");
+    desc.add_options()
+        ("help,h", "print this help")
+        ("producers,p", po::value<unsigned int>(&max_producers)->default_value(hw / 2),
+         "sweep 1, 2, 4, ... up to this many producers")
+        ("consumers,c", po::value<unsigned int>(&max_consumers)->default_value(hw / 2),
+         "sweep 1, 2, 4, ... up to this many consumers")
+        ("ops,n", po::value<unsigned long>(&opt.ops)->default_value(200000),
+         "items moved through the queue per run")
+        ("payload", po::value<std::vector<unsigned long>>(&opt.payloads)->multitoken()
+             ->default_value({16, 64, 256}, "16 64 256"),
+         "item sizes in bytes, any of 16 32 64 128 256")
+        ("capacity", po::value<std::vector<unsigned long>>(&opt.capacities)->multitoken()
+             ->default_value({64, 1024, 16384}, "64 1024 16384"),
+         "bounded queue capacities, rounded up to a power of two by the rings")
+        ("queue", po::value<std::vector<std::string>>(&opt.queues)->multitoken()
+             ->default_value({"blocking", "fixed_semaphore", "fixed_fast_semaphore", "segmented", "atomic", "mpmc", "lockfree", "spsc"},
+                             "blocking fixed_semaphore fixed_fast_semaphore segmented atomic mpmc lockfree spsc"),
+         "queue variants to run, also fixed_futex_semaphore and atomic_futex on Linux; spsc runs with 1 producer and 1 consumer only")
+        ("json", po::bool_switch(&opt.json), "write JSON lines instead of CSV");
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    }
+    catch(const po::error& e)
+    {
+        std::cerr << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+
+    if(vm.count("help"))
+    {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    if(!max_producers || !max_consumers || !opt.ops)
+    {
+        std::cerr << "producers, consumers and ops must be positive" << std::endl;
+        return 1;
+    }
+
+    static const std::vector<unsigned long> payloads{16, 32, 64, 128, 256};
+    for(auto payload : opt.payloads)
+        if(!options::has(payloads, payload))
+        {
+            std::cerr << "payload must be one of 16 32 64 128 256" << std::endl;
+            return 1;
+        }
+
+    for(auto capacity : opt.capacities)
+        if(!capacity || capacity > (1ul << 30))
+        {
+            std::cerr << "capacity must be between 1 and 2^30" << std::endl;
+            return 1;
+        }
+
+    opt.producers = powers_up_to(max_producers);
+    opt.consumers = powers_up_to(max_consumers);
+
+    if(!opt.json)
+        std::cout << "queue,payload,capacity,producers,consumers,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns" << std::endl;
+
+    sweep_payload<16>(opt);
+    sweep_payload<32>(opt);
+    sweep_payload<64>(opt);
+    sweep_payload<128>(opt);
+    sweep_payload<256>(opt);
+
+    return 0;
+}
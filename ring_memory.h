@@ -0,0 +1,133 @@
+/*
+ * ------------------------------------------------------------------------
+ * Backing memory of the ring buffers.
+ *
+ * Ring capacities are chosen at construction and rounded up to a power of
+ * two, so a slot is still found with a mask, only one loaded from the ring
+ * instead of a constant. The template Q_SIZE of a ring is just the
+ * capacity its default constructor picks.
+ *
+ * A ring of at least one huge page can be mapped on huge pages: either
+ * explicitly reserved ones (MAP_HUGETLB, see /proc/sys/vm/nr_hugepages),
+ * falling back to transparent ones when none are left, or transparent
+ * ones right away (madvise(MADV_HUGEPAGE)). Smaller rings, and every ring
+ * off Linux, stay on the heap. Prefaulting touches every page from the
+ * constructing thread, which also places pages not touched before on its
+ * NUMA node; a small ring on heap pages already in use stays where they
+ * are.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <new>
+#include <cstddef>
+#include <utility>
+#include <stdexcept>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+enum class ring_pages
+{
+    normal,
+    transparent,
+    huge
+};
+
+struct ring_options
+{
+    // Backing of rings of at least one huge page.
+    ring_pages pages = ring_pages::normal;
+    // Touch every page at construction, not on the first push.
+    bool prefault = false;
+};
+
+/*
+ * capacity rounded up to a power of two. The semaphores in front of a ring
+ * count in an int, so it may not exceed 2^30.
+ */
+inline unsigned long ring_capacity(unsigned long capacity)
+{
+    if(!capacity || capacity > (1ul << 30))
+        throw std::invalid_argument("Invalid queue size!");
+    unsigned long size = 1;
+    while(size < capacity)
+        size <<= 1;
+    return size;
+}
+
+class ring_memory
+{
+public:
+    static constexpr std::size_t page_size = 4096;
+    static constexpr std::size_t huge_page_size = 2ul << 20;
+
+    ring_memory(std::size_t bytes, const ring_options& options)
+    : m_bytes(bytes)
+    {
+#ifdef __linux__
+        if(options.pages != ring_pages::normal && bytes >= huge_page_size)
+            m_data = map(options.pages);
+#endif
+        if(!m_data)
+            m_data = ::operator new(bytes, std::align_val_t(page_size));
+        if(options.prefault)
+            prefault();
+    }
+
+    ring_memory(const ring_memory&) = delete;
+    ring_memory& operator=(const ring_memory&) = delete;
+
+    ~ring_memory() noexcept
+    {
+#ifdef __linux__
+        if(m_mapped)
+        {
+            munmap(m_data, m_mapped);
+            return;
+        }
+#endif
+        ::operator delete(m_data, std::align_val_t(page_size));
+    }
+
+    void* data() const noexcept
+    {
+        return m_data;
+    }
+
+    /*
+     * Writes one byte per page of the still empty ring so its pages get
+     * placed now, by the calling thread, and not by the first push.
+     */
+    void prefault() noexcept
+    {
+        auto bytes = static_cast<volatile char*>(m_data);
+        for(std::size_t i = 0; i < m_bytes; i += page_size)
+            bytes[i] = 0;
+    }
+
+private:
+#ifdef __linux__
+    void* map(ring_pages pages) noexcept
+    {
+        const auto length = (m_bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+        void* data = MAP_FAILED;
+        if(pages == ring_pages::huge)
+            data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(data == MAP_FAILED)
+        {
+            data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(data == MAP_FAILED)
+                return nullptr;
+            // Only advice, the ring works on small pages as well.
+            madvise(data, length, MADV_HUGEPAGE);
+        }
+        m_mapped = length;
+        return data;
+    }
+#endif
+
+    void* m_data = nullptr;
+    std::size_t m_bytes;
+    std::size_t m_mapped = 0;
+};
@@ -0,0 +1,349 @@
+/*
+ * ------------------------------------------------------------------------
+ * Unbounded lock-free multi producer multi consumer queue of linked
+ * fixed-size segments.
+ *
+ * Producers and consumers each claim a position with a compare-exchange
+ * on their own index, whose offset within the current segment says which
+ * slot they own. Offset SEG_SIZE is not a slot but marks a new segment
+ * being linked in: the producer taking the last slot of a segment links
+ * the next one, the consumer taking it moves the head on, and whoever
+ * finds the index parked there waits for that. A slot is handed from
+ * producer to consumer through its WRITE bit, so nobody waits on anyone
+ * but the owner of the very slot it wants.
+ *
+ * A segment is never touched by a producer once all its slots are claimed
+ * and is reclaimed by the last consumer to leave it: the consumer of the
+ * last slot walks the others and either finds them READ or marks them
+ * DESTROY, passing the job to the consumer still inside. Reclaimed
+ * segments go back on a free list, up to spares of them, and the rest is
+ * freed, so the queue grows with a burst and shrinks back after it.
+ *
+ * Pushing never blocks. An S counts the items, popping waits on it and
+ * done() wakes every waiting consumer. W is how a thread waits for a slot
+ * or segment another one is still busy with, see wait_strategy.h.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <iterator>
+#include <stdexcept>
+#include "semaphore.h"
+#include "wait_strategy.h"
+
+template<typename T,
+         typename S = fast_semaphore,
+         unsigned long SEG_SIZE = 256ul,
+         typename W = yield_wait>
+class segmented_queue
+{
+public:
+    static_assert(SEG_SIZE > 1, "SEG_SIZE must hold at least two items!");
+
+    explicit segmented_queue(unsigned int spares = 4)
+    : m_items(0), m_spares(spares)
+    {
+        auto first = new segment();
+        m_head.block.store(first, std::memory_order_relaxed);
+        m_tail.block.store(first, std::memory_order_relaxed);
+    }
+
+    segmented_queue(const segmented_queue&) = delete;
+    segmented_queue& operator=(const segmented_queue&) = delete;
+
+    ~segmented_queue() noexcept
+    {
+        const auto tail = m_tail.index.load(std::memory_order_acquire);
+        auto block = m_head.block.load(std::memory_order_relaxed);
+        for(auto head = m_head.index.load(std::memory_order_relaxed); head != tail; ++head)
+        {
+            const auto offset = head % LAP;
+            if(offset == SEG_SIZE)
+                delete std::exchange(block, block->next.load(std::memory_order_relaxed));
+            else
+                block->slots[offset].item()->~T();
+        }
+        delete block;
+
+        for(auto free = m_free.load(std::memory_order_relaxed); free; )
+            delete std::exchange(free, free->free_next);
+    }
+
+    void push(T&& item) noexcept
+    {
+        enqueue(std::move(item));
+        m_items.post();
+    }
+
+    /*
+     * Never fails, the queue is unbounded.
+     */
+    bool try_push(T&& item) noexcept
+    {
+        push(std::move(item));
+        return true;
+    }
+
+    template<typename Rep, typename Period>
+    bool push_for(T&& item, const std::chrono::duration<Rep, Period>&) noexcept
+    {
+        push(std::move(item));
+        return true;
+    }
+
+    template<typename Clock, typename Duration>
+    bool push_until(T&& item, const std::chrono::time_point<Clock, Duration>&) noexcept
+    {
+        push(std::move(item));
+        return true;
+    }
+
+    bool pop(T& item) noexcept
+    {
+        if(!m_items.wait())
+            return false;
+        dequeue(item);
+        return true;
+    }
+
+    bool try_pop(T& item) noexcept
+    {
+        if(!m_items.wait_for(std::chrono::seconds(0)))
+            return false;
+        dequeue(item);
+        return true;
+    }
+
+    template<typename Rep, typename Period>
+    bool pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout) noexcept
+    {
+        if(!m_items.wait_for(timeout))
+            return false;
+        dequeue(item);
+        return true;
+    }
+
+    template<typename Clock, typename Duration>
+    bool pop_until(T& item, const std::chrono::time_point<Clock, Duration>& deadline) noexcept
+    {
+        if(!m_items.wait_until(deadline))
+            return false;
+        dequeue(item);
+        return true;
+    }
+
+    /*
+     * Moves [first, last) in, posting the consumers once.
+     */
+    template<typename It>
+    unsigned int push_bulk(It first, It last) noexcept
+    {
+        unsigned int n = 0;
+        for(; first != last; ++first, ++n)
+            enqueue(std::move(*first));
+        if(n)
+            m_items.post(n);
+        return n;
+    }
+
+    /*
+     * Blocks for the first item, then takes up to max without blocking.
+     * Returns the number of items written to out, 0 once done.
+     */
+    template<typename It>
+    unsigned int pop_bulk(It out, unsigned int max) noexcept
+    {
+        if(!max || !m_items.wait())
+            return 0;
+
+        const unsigned int n = 1 + m_items.try_wait_many(max - 1);
+        for(unsigned int i = 0; i < n; ++i, ++out)
+            dequeue(*out);
+        return n;
+    }
+
+    void done() noexcept
+    {
+        m_items.done();
+    }
+
+private:
+    // One position per lap is the "next segment on its way" marker.
+    static constexpr unsigned long LAP = SEG_SIZE + 1;
+
+    static constexpr unsigned int WRITE = 1;
+    static constexpr unsigned int READ = 2;
+    static constexpr unsigned int DESTROY = 4;
+
+    struct slot
+    {
+        std::atomic_uint state = 0;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T* item() noexcept
+        {
+            return std::launder(reinterpret_cast<T*>(storage));
+        }
+    };
+
+    struct segment
+    {
+        std::atomic<segment*> next = nullptr;
+        segment* free_next = nullptr;
+        slot slots[SEG_SIZE];
+    };
+
+    struct alignas(64) position
+    {
+        std::atomic<unsigned long> index = 0;
+        std::atomic<segment*> block = nullptr;
+    };
+
+    void enqueue(T&& item) noexcept
+    {
+        auto tail = m_tail.index.load(std::memory_order_acquire);
+        W w;
+        while(true)
+        {
+            const auto offset = tail % LAP;
+            if(offset == SEG_SIZE)
+            {
+                w.pause();
+                tail = m_tail.index.load(std::memory_order_acquire);
+                continue;
+            }
+
+            // Still the segment of tail if the exchange below succeeds.
+            auto block = m_tail.block.load(std::memory_order_acquire);
+            if(!m_tail.index.compare_exchange_weak(tail, tail + 1, std::memory_order_seq_cst, std::memory_order_acquire))
+                continue;
+
+            if(offset + 1 == SEG_SIZE)
+            {
+                auto next = acquire_segment();
+                m_tail.block.store(next, std::memory_order_release);
+                m_tail.index.store(tail + 2, std::memory_order_release);
+                block->next.store(next, std::memory_order_release);
+            }
+
+            auto& s = block->slots[offset];
+            new (s.item()) T (std::move(item));
+            s.state.fetch_or(WRITE, std::memory_order_release);
+            return;
+        }
+    }
+
+    /*
+     * The caller holds one count of m_items, so there is an item to take.
+     */
+    template<typename U>
+    void dequeue(U& item) noexcept
+    {
+        auto head = m_head.index.load(std::memory_order_acquire);
+        W w;
+        while(true)
+        {
+            const auto offset = head % LAP;
+            if(offset == SEG_SIZE)
+            {
+                w.pause();
+                head = m_head.index.load(std::memory_order_acquire);
+                continue;
+            }
+
+            auto block = m_head.block.load(std::memory_order_acquire);
+            if(!m_head.index.compare_exchange_weak(head, head + 1, std::memory_order_seq_cst, std::memory_order_acquire))
+                continue;
+
+            if(offset + 1 == SEG_SIZE)
+            {
+                auto next = block->next.load(std::memory_order_acquire);
+                while(!next)
+                {
+                    w.pause();
+                    next = block->next.load(std::memory_order_acquire);
+                }
+                m_head.block.store(next, std::memory_order_release);
+                m_head.index.store(head + 2, std::memory_order_release);
+            }
+
+            auto& s = block->slots[offset];
+            while(!(s.state.load(std::memory_order_acquire) & WRITE))
+                w.pause();
+            item = std::move(*s.item());
+            s.item()->~T();
+
+            if(offset + 1 == SEG_SIZE)
+                reclaim(block, 0);
+            else if(s.state.fetch_or(READ, std::memory_order_acq_rel) & DESTROY)
+                reclaim(block, offset + 1);
+            return;
+        }
+    }
+
+    /*
+     * Releases block once every consumer of its slots from start on has
+     * left, or leaves that to the first one still inside.
+     */
+    void reclaim(segment* block, unsigned long start) noexcept
+    {
+        for(auto i = start; i < SEG_SIZE - 1; ++i)
+        {
+            auto& s = block->slots[i];
+            if(!(s.state.load(std::memory_order_acquire) & READ) &&
+               !(s.state.fetch_or(DESTROY, std::memory_order_acq_rel) & READ))
+                return;
+        }
+        release_segment(block);
+    }
+
+    /*
+     * Only the producer linking the next segment pops the free list, one
+     * at a time, so a plain compare-exchange on its top has no ABA.
+     */
+    segment* acquire_segment()
+    {
+        auto top = m_free.load(std::memory_order_acquire);
+        do
+        {
+            if(!top)
+                return new segment();
+        }
+        while(!m_free.compare_exchange_weak(top, top->free_next, std::memory_order_acquire));
+        m_freeCount.fetch_sub(1, std::memory_order_relaxed);
+        return top;
+    }
+
+    void release_segment(segment* block) noexcept
+    {
+        if(m_freeCount.fetch_add(1, std::memory_order_relaxed) >= m_spares)
+        {
+            m_freeCount.fetch_sub(1, std::memory_order_relaxed);
+            delete block;
+            return;
+        }
+
+        block->next.store(nullptr, std::memory_order_relaxed);
+        for(auto& s : block->slots)
+            s.state.store(0, std::memory_order_relaxed);
+
+        auto top = m_free.load(std::memory_order_relaxed);
+        do
+            block->free_next = top;
+        while(!m_free.compare_exchange_weak(top, block, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    position m_head;
+    position m_tail;
+
+    alignas(64) std::atomic<segment*> m_free = nullptr;
+    std::atomic_uint m_freeCount = 0;
+
+    alignas(64) S m_items;
+    const unsigned int m_spares;
+};
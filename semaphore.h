@@ -2,14 +2,24 @@
  * fast_semaphore designed by Joe Seigh, implemented by Chris Thomasson
  *
  * https://www.haiku-os.org/legacy-docs/benewsletter/Issue1-26.html
+ * https://man7.org/linux/man-pages/man2/futex.2.html
  */
 #pragma once
 
 #include <mutex>
+#include <algorithm>
 #include <atomic>
 #include <condition_variable>
 #include <iostream>
 #include <limits.h>
+#include <chrono>
+#include "wait_strategy.h"
+#ifdef __linux__
+#include <ctime>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 class semaphore
 {
@@ -28,6 +38,22 @@ public:
         m_cv.notify_one();
     }
 
+    void post(unsigned int n) noexcept
+    {
+        if(!n)
+            return;
+        {
+            std::unique_lock lock(m_mutex);
+
+            m_count += n;
+        }
+
+        if(n == 1)
+            m_cv.notify_one();
+        else
+            m_cv.notify_all();
+    }
+
     [[nodiscard]] bool wait() noexcept
     {
         std::unique_lock lock(m_mutex);
@@ -54,7 +80,7 @@ public:
     }
 
     template<typename T>
-    bool wait_until(T&& t) noexcept
+    [[nodiscard]] bool wait_until(T&& t) noexcept
     {
         std::unique_lock lock(m_mutex);
 
@@ -66,6 +92,18 @@ public:
         return wait_result;
     }
 
+    /*
+     * Takes up to max counts without blocking, returns how many were taken.
+     */
+    unsigned int try_wait_many(unsigned int max) noexcept
+    {
+        std::unique_lock lock(m_mutex);
+
+        auto n = std::min(m_count, max);
+        m_count -= n;
+        return n;
+    }
+
     void done() noexcept
     {
         {
@@ -83,10 +121,15 @@ private:
     bool m_done = false;
 };
 
-class fast_semaphore
+/*
+ * W decides how long a waiter spins on the count before it blocks on the
+ * semaphore underneath, see wait_strategy.h.
+ */
+template<typename W>
+class basic_fast_semaphore
 {
 public:
-    explicit fast_semaphore(int init_count = 0) noexcept
+    explicit basic_fast_semaphore(int init_count = 0) noexcept
     : m_count(init_count), m_semaphore(0) {}
 
     void post() noexcept
@@ -99,21 +142,55 @@ public:
         }
     }
 
-    bool waitWithPartialSpinning()
+    void post(int n) noexcept
     {
-        int oldCount;
-        // Is there a better way to set the initial spin count?
-        // If we lower it to 1000, testBenaphore becomes 15x slower on my Core i7-5930K Windows PC,
+        if(n <= 0)
+            return;
+
+        int oldCount = m_count.fetch_add(n, std::memory_order_release);
+
+        if (oldCount < 0)
+        {
+            m_semaphore.post(static_cast<unsigned int>(std::min(-oldCount, n)));
+        }
+    }
+
+    bool spin()
+    {
+        return spin([]() { return false; });
+    }
+
+    /*
+     * Spins until W would rather park, done() or expired().
+     */
+    template<typename Expired>
+    bool spin(Expired&& expired)
+    {
+        // The spin count of spin_then_park_wait: if we lower it to 1000,
+        // testBenaphore becomes 15x slower on a Core i7-5930K Windows PC,
         // as threads start hitting the kernel semaphore.
-        int spin = 10000;
-        while (spin--)
+        // done() and the clock are looked at every 64th round only.
+        W w;
+        while (true)
         {
-            oldCount = m_count.load(std::memory_order_relaxed);
-            if ((oldCount > 0) && m_count.compare_exchange_strong(oldCount, oldCount - 1, std::memory_order_acquire))
-                return true;
-            std::atomic_signal_fence(std::memory_order_acquire);     // Prevent the compiler from collapsing the loop.
+            for (int n = 0; n < 64; ++n)
+            {
+                int oldCount = m_count.load(std::memory_order_relaxed);
+                if ((oldCount > 0) && m_count.compare_exchange_strong(oldCount, oldCount - 1, std::memory_order_acquire))
+                    return true;
+                if (!w.spin())
+                    return false;
+            }
+            if (m_done.load(std::memory_order_relaxed) || expired())
+                return false;
         }
-        oldCount = m_count.fetch_sub(1, std::memory_order_acquire);
+    }
+
+    bool waitWithPartialSpinning()
+    {
+        if (spin())
+            return true;
+        int oldCount = m_count.fetch_sub(1, std::memory_order_acquire);
         if (oldCount <= 0)
         {
             return m_semaphore.wait();
@@ -121,12 +198,50 @@ public:
         return true;
     }
 
+    template<typename Clock, typename Duration>
+    bool waitWithPartialSpinning(const std::chrono::time_point<Clock, Duration>& deadline)
+    {
+        if (spin([&deadline]() { return Clock::now() >= deadline; }))
+            return true;
+        int oldCount = m_count.fetch_sub(1, std::memory_order_acquire);
+        if (oldCount > 0)
+            return true;
+        if (m_semaphore.wait_until(deadline))
+            return true;
+
+        // Timed out. Withdraw our claim on the count, unless a post() raced
+        // with the timeout and already handed a unit to the kernel semaphore.
+        while (true)
+        {
+            oldCount = m_count.load(std::memory_order_relaxed);
+            if (oldCount >= 0 && m_semaphore.wait_for(std::chrono::seconds(0)))
+                return true;
+            if (oldCount < 0 && m_count.compare_exchange_strong(oldCount, oldCount + 1, std::memory_order_relaxed))
+                return false;
+        }
+    }
+
     bool tryWait()
     {
         int oldCount = m_count.load(std::memory_order_relaxed);
         return (oldCount > 0 && m_count.compare_exchange_strong(oldCount, oldCount - 1, std::memory_order_acquire));
     }
 
+    /*
+     * Takes up to max counts without blocking, returns how many were taken.
+     */
+    int try_wait_many(int max) noexcept
+    {
+        int oldCount = m_count.load(std::memory_order_relaxed);
+        while (oldCount > 0 && max > 0)
+        {
+            int n = std::min(oldCount, max);
+            if (m_count.compare_exchange_weak(oldCount, oldCount - n, std::memory_order_acquire, std::memory_order_relaxed))
+                return n;
+        }
+        return 0;
+    }
+
     [[nodiscard]] bool wait() noexcept
     {
         if (!tryWait())
@@ -138,15 +253,217 @@ public:
     template<typename T>
     [[nodiscard]] bool wait_for(T&& t) noexcept
     {
-        return tryWait();
+        if (tryWait())
+            return true;
+        if (t <= t.zero())
+            return false;
+        return waitWithPartialSpinning(std::chrono::steady_clock::now() + t);
+    }
+
+    template<typename Clock, typename Duration>
+    [[nodiscard]] bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline) noexcept
+    {
+        if (tryWait())
+            return true;
+        if (Clock::now() >= deadline)
+            return false;
+        return waitWithPartialSpinning(deadline);
     }
 
     void done() noexcept
     {
+        m_done.store(true, std::memory_order_relaxed);
         m_semaphore.done();
     }
 
 private:
     std::atomic_int m_count;
+    // Ends the spinning of waiters which would never park.
+    std::atomic<bool> m_done = false;
     semaphore m_semaphore;
 };
+
+using fast_semaphore = basic_fast_semaphore<spin_then_park_wait<>>;
+
+#ifdef __linux__
+/*
+ * Counting semaphore which sleeps with FUTEX_WAIT directly on its count,
+ * so neither post() nor a wake up ever touches a mutex. post() enters the
+ * kernel only when somebody is actually sleeping.
+ *
+ * The top bit of the count word is the done flag; setting it changes the
+ * word, which kicks every sleeper out of FUTEX_WAIT. W decides how long a
+ * waiter spins before it sleeps, see wait_strategy.h.
+ */
+template<typename W>
+class basic_futex_semaphore
+{
+public:
+    explicit basic_futex_semaphore(int init_count = 0) noexcept
+    : m_count(init_count), m_waiters(0) {}
+
+    void post() noexcept
+    {
+        post(1);
+    }
+
+    void post(int n) noexcept
+    {
+        if(n <= 0)
+            return;
+
+        m_count.fetch_add(n, std::memory_order_seq_cst);
+
+        if(m_waiters.load(std::memory_order_seq_cst))
+            futex_wake(n);
+    }
+
+    bool tryWait() noexcept
+    {
+        int oldCount = m_count.load(std::memory_order_relaxed);
+        while(oldCount & COUNT_MASK)
+        {
+            if(m_count.compare_exchange_weak(oldCount, oldCount - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+
+    /*
+     * Takes up to max counts without blocking, returns how many were taken.
+     */
+    int try_wait_many(int max) noexcept
+    {
+        int oldCount = m_count.load(std::memory_order_relaxed);
+        while((oldCount & COUNT_MASK) && max > 0)
+        {
+            int n = std::min(oldCount & COUNT_MASK, max);
+            if(m_count.compare_exchange_weak(oldCount, oldCount - n, std::memory_order_acquire, std::memory_order_relaxed))
+                return n;
+        }
+        return 0;
+    }
+
+    [[nodiscard]] bool wait() noexcept
+    {
+        if(tryWait() || spin())
+            return true;
+
+        while(true)
+        {
+            if(tryWait())
+                return true;
+
+            int oldCount = m_count.load(std::memory_order_relaxed);
+            if(oldCount & DONE)
+                return false;
+            if(oldCount & COUNT_MASK)
+                continue;
+
+            m_waiters.fetch_add(1, std::memory_order_seq_cst);
+            futex_wait(oldCount, nullptr);
+            m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    template<typename T>
+    [[nodiscard]] bool wait_for(T&& t) noexcept
+    {
+        if(tryWait())
+            return true;
+        if(t <= t.zero())
+            return false;
+        return wait_until(std::chrono::steady_clock::now() + t);
+    }
+
+    template<typename Clock, typename Duration>
+    [[nodiscard]] bool wait_until(const std::chrono::time_point<Clock, Duration>& deadline) noexcept
+    {
+        if(tryWait())
+            return true;
+        if(Clock::now() >= deadline)
+            return false;
+        if(spin([&deadline]() { return Clock::now() >= deadline; }))
+            return true;
+
+        while(true)
+        {
+            if(tryWait())
+                return true;
+
+            int oldCount = m_count.load(std::memory_order_relaxed);
+            if(oldCount & DONE)
+                return false;
+            if(oldCount & COUNT_MASK)
+                continue;
+
+            auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now()).count();
+            if(left <= 0)
+                return false;
+
+            timespec timeout;
+            timeout.tv_sec = static_cast<time_t>(left / 1000000000);
+            timeout.tv_nsec = static_cast<long>(left % 1000000000);
+
+            m_waiters.fetch_add(1, std::memory_order_seq_cst);
+            futex_wait(oldCount, &timeout);
+            m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void done() noexcept
+    {
+        m_count.fetch_or(DONE, std::memory_order_seq_cst);
+        futex_wake(INT_MAX);
+    }
+
+private:
+    static constexpr int DONE = 1 << 30;
+    static constexpr int COUNT_MASK = DONE - 1;
+
+    bool spin() noexcept
+    {
+        return spin([]() { return false; });
+    }
+
+    /*
+     * Spins until W would rather park, done() or expired().
+     */
+    template<typename Expired>
+    bool spin(Expired&& expired) noexcept
+    {
+        // The clock is looked at every 64th round only.
+        W w;
+        while (true)
+        {
+            for (int n = 0; n < 64; ++n)
+            {
+                int oldCount = m_count.load(std::memory_order_relaxed);
+                if ((oldCount & COUNT_MASK) && m_count.compare_exchange_strong(oldCount, oldCount - 1, std::memory_order_acquire))
+                    return true;
+                if ((oldCount & DONE) || !w.spin())
+                    return false;
+            }
+            if (expired())
+                return false;
+        }
+    }
+
+    void futex_wait(int expected, const timespec* timeout) noexcept
+    {
+        syscall(SYS_futex, reinterpret_cast<int*>(&m_count), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+    }
+
+    void futex_wake(int n) noexcept
+    {
+        syscall(SYS_futex, reinterpret_cast<int*>(&m_count), FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+    }
+
+    static_assert(sizeof(std::atomic_int) == sizeof(int), "futex needs a plain int count word!");
+
+    alignas(64) std::atomic_int m_count;
+    std::atomic_int m_waiters;
+};
+
+using futex_semaphore = basic_futex_semaphore<spin_then_park_wait<>>;
+#endif
@@ -0,0 +1,203 @@
+/*
+ * ------------------------------------------------------------------------
+ * Wait-free single producer single consumer ring.
+ *
+ * The producer owns the tail, the consumer the head, each on its own cache
+ * line together with a cached copy of the other side's index. The other
+ * side's index is only loaded again when the cached one says the ring is
+ * full (or empty), so in the steady state a push or pop touches no line
+ * the other thread writes. The bulk calls move a whole batch and publish
+ * it with a single store.
+ *
+ * Plugs into atomic_blocking_queue as its Q, whose semaphores guarantee
+ * room for push() and an item for pop(). The atomic_blocking_queue then
+ * must have exactly one pushing and one popping thread, so it is no
+ * replacement for the shared queues of a pool; see pool_channel.h.
+ *
+ * Q_SIZE is the default capacity, see ring_memory.h.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <cassert>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include "ring_memory.h"
+
+template<typename T,
+         unsigned long Q_SIZE = 4096ul>
+class spsc_ring
+{
+public:
+    explicit spsc_ring(unsigned long capacity = Q_SIZE, const ring_options& options = ring_options())
+    :
+      m_size(ring_capacity(capacity)),
+      m_mask(m_size - 1),
+      m_memory(sizeof(T) * m_size, options),
+      m_data(static_cast<T*>(m_memory.data()))
+    {
+    }
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    ~spsc_ring() noexcept
+    {
+        const auto tail = m_producer.tail.load(std::memory_order_acquire);
+        for(auto head = m_consumer.head.load(std::memory_order_relaxed); head != tail; ++head)
+            m_data[head & m_mask].~T();
+    }
+
+    unsigned long capacity() const noexcept
+    {
+        return m_size;
+    }
+
+    /*
+     * Producer side.
+     */
+    bool try_push(T&& item) noexcept
+    {
+        const auto tail = m_producer.tail.load(std::memory_order_relaxed);
+        if(tail - m_producer.head == m_size)
+        {
+            m_producer.head = m_consumer.head.load(std::memory_order_acquire);
+            if(tail - m_producer.head == m_size)
+                return false;
+        }
+        new (m_data + (tail & m_mask)) T (std::move(item));
+        m_producer.tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*
+     * The caller guarantees there is room.
+     */
+    void push(T&& item) noexcept
+    {
+        [[maybe_unused]] const bool pushed = try_push(std::move(item));
+        assert(pushed);
+    }
+
+    /*
+     * Moves in as much of [first, last) as fits, returns how much.
+     */
+    template<typename It>
+    unsigned int try_push_bulk(It first, It last) noexcept
+    {
+        const auto tail = m_producer.tail.load(std::memory_order_relaxed);
+        const auto wanted = static_cast<unsigned long>(std::distance(first, last));
+        if(m_size - (tail - m_producer.head) < wanted)
+            m_producer.head = m_consumer.head.load(std::memory_order_acquire);
+
+        const auto n = std::min(wanted, m_size - (tail - m_producer.head));
+        for(unsigned long i = 0; i < n; ++i, ++first)
+            new (m_data + ((tail + i) & m_mask)) T (std::move(*first));
+        if(n)
+            m_producer.tail.store(tail + n, std::memory_order_release);
+        return static_cast<unsigned int>(n);
+    }
+
+    /*
+     * The caller guarantees there is room for all of [first, last).
+     */
+    template<typename It>
+    void push_bulk(It first, It last) noexcept
+    {
+        [[maybe_unused]] const auto wanted = static_cast<unsigned int>(std::distance(first, last));
+        [[maybe_unused]] const auto pushed = try_push_bulk(first, last);
+        assert(pushed == wanted);
+    }
+
+    /*
+     * Consumer side.
+     */
+    bool try_pop(T& item) noexcept
+    {
+        const auto head = m_consumer.head.load(std::memory_order_relaxed);
+        if(head == m_consumer.tail)
+        {
+            m_consumer.tail = m_producer.tail.load(std::memory_order_acquire);
+            if(head == m_consumer.tail)
+                return false;
+        }
+        item = std::move(m_data[head & m_mask]);
+        m_data[head & m_mask].~T();
+        m_consumer.head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*
+     * The caller guarantees there is an item.
+     */
+    void pop(T& item) noexcept
+    {
+        [[maybe_unused]] const bool popped = try_pop(item);
+        assert(popped);
+    }
+
+    /*
+     * Moves out up to max items, returns how many.
+     */
+    template<typename It>
+    unsigned int try_pop_bulk(It out, unsigned int max) noexcept
+    {
+        const auto head = m_consumer.head.load(std::memory_order_relaxed);
+        if(m_consumer.tail - head < max)
+            m_consumer.tail = m_producer.tail.load(std::memory_order_acquire);
+
+        const auto n = std::min<unsigned long>(max, m_consumer.tail - head);
+        for(unsigned long i = 0; i < n; ++i, ++out)
+        {
+            *out = std::move(m_data[(head + i) & m_mask]);
+            m_data[(head + i) & m_mask].~T();
+        }
+        if(n)
+            m_consumer.head.store(head + n, std::memory_order_release);
+        return static_cast<unsigned int>(n);
+    }
+
+    /*
+     * The caller guarantees there are n items.
+     */
+    template<typename It>
+    void pop_bulk(It out, unsigned int n) noexcept
+    {
+        [[maybe_unused]] const auto popped = try_pop_bulk(out, n);
+        assert(popped == n);
+    }
+
+    /*
+     * Writes one byte per page of the still empty ring so its pages get
+     * placed now, by the calling thread, and not by the first push.
+     */
+    void prefault() noexcept
+    {
+        m_memory.prefault();
+    }
+
+private:
+    // Written by the producer only; head is its cached copy of the consumer's.
+    struct alignas(64) producer
+    {
+        std::atomic<unsigned long> tail = 0;
+        unsigned long head = 0;
+    };
+
+    // Written by the consumer only; tail is its cached copy of the producer's.
+    struct alignas(64) consumer
+    {
+        std::atomic<unsigned long> head = 0;
+        unsigned long tail = 0;
+    };
+
+    producer m_producer;
+    consumer m_consumer;
+    const unsigned long m_size;
+    const unsigned long m_mask;
+    ring_memory m_memory;
+    T* m_data;
+};
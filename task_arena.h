@@ -0,0 +1,255 @@
+/*
+ * ------------------------------------------------------------------------
+ * Slab arena for task closures and task shared state.
+ *
+ * Every thread owns a cache with one free list per size class (64 bytes
+ * to 2 KiB in powers of two), refilled from 64 KiB slabs it carves up
+ * itself. A block freed by its owner goes straight back on the owner's
+ * list. A block freed elsewhere, typically by the worker running the
+ * task a producer allocated, is pushed onto the owner's lock-free return
+ * stack for that class, which the owner takes over as a whole once its
+ * own list runs dry; the exchange makes the stack immune to ABA. Slabs are
+ * aligned to their size, so the owner of a block is found by masking its
+ * address and blocks carry no header.
+ *
+ * Slabs are never handed back to the system. The cache of an exiting
+ * thread is parked, blocks still out keep coming back to it, and the next
+ * thread to start adopts it, so the arena is bounded by the peak number
+ * of threads rather than by how many came and went.
+ *
+ * Anything bigger than the largest class or aligned beyond 64 bytes is
+ * passed on to the global allocator. resource() exposes the arena as a
+ * std::pmr::memory_resource for user closures.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <memory_resource>
+
+class task_arena
+{
+public:
+    static constexpr std::size_t slab_size = 64 * 1024;
+    static constexpr std::size_t min_block = 64;
+    static constexpr std::size_t max_block = 2048;
+
+    /*
+     * Whether the arena serves bytes at that alignment itself.
+     */
+    static constexpr bool pooled(std::size_t bytes, std::size_t alignment) noexcept
+    {
+        return bytes <= max_block && alignment <= min_block;
+    }
+
+    static void* allocate(std::size_t bytes, std::size_t alignment = alignof(std::max_align_t))
+    {
+        if(!pooled(bytes, alignment))
+            return ::operator new(bytes, std::align_val_t(alignment));
+
+        if(auto cache = local())
+            return cache->allocate(size_class(bytes));
+
+        // This thread is past its exit, borrow a parked cache.
+        auto& p = parked();
+        std::scoped_lock lock(p.mutex);
+        auto cache = p.adopt();
+        auto block = cache->allocate(size_class(bytes));
+        p.park(cache);
+        return block;
+    }
+
+    /*
+     * bytes and alignment as passed to allocate().
+     */
+    static void deallocate(void* ptr, std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) noexcept
+    {
+        if(!ptr)
+            return;
+        if(!pooled(bytes, alignment))
+        {
+            ::operator delete(ptr, std::align_val_t(alignment));
+            return;
+        }
+
+        auto owner = slab_of(ptr)->owner;
+        const auto c = size_class(bytes);
+        if(owner == t_cache.owned)
+            owner->release_local(c, static_cast<block*>(ptr));
+        else
+            owner->release_remote(c, static_cast<block*>(ptr));
+    }
+
+    static std::pmr::memory_resource* resource() noexcept
+    {
+        static arena_resource r;
+        return &r;
+    }
+
+private:
+    static constexpr unsigned int classes = 6;
+
+    struct block
+    {
+        block* next;
+    };
+
+    struct cache;
+
+    // First min_block bytes of every slab, the blocks follow.
+    struct alignas(min_block) slab
+    {
+        cache* owner;
+        slab* next;
+    };
+
+    struct alignas(64) size_class_cache
+    {
+        block* local = nullptr;
+        char* bump = nullptr;
+        char* end = nullptr;
+        std::atomic<block*> returned = nullptr;
+    };
+
+    struct cache
+    {
+        size_class_cache lists[classes];
+        slab* slabs = nullptr;
+        cache* next_parked = nullptr;
+
+        void* allocate(unsigned int c)
+        {
+            auto& l = lists[c];
+            if(!l.local)
+                l.local = l.returned.exchange(nullptr, std::memory_order_acquire);
+            if(l.local)
+                return std::exchange(l.local, l.local->next);
+
+            const auto size = min_block << c;
+            if(l.bump == l.end)
+            {
+                auto s = new (::operator new(slab_size, std::align_val_t(slab_size))) slab{this, slabs};
+                slabs = s;
+                l.bump = reinterpret_cast<char*>(s) + sizeof(slab);
+                l.end = reinterpret_cast<char*>(s) + slab_size - (slab_size - sizeof(slab)) % size;
+            }
+            return std::exchange(l.bump, l.bump + size);
+        }
+
+        void release_local(unsigned int c, block* b) noexcept
+        {
+            b->next = lists[c].local;
+            lists[c].local = b;
+        }
+
+        void release_remote(unsigned int c, block* b) noexcept
+        {
+            auto& returned = lists[c].returned;
+            auto head = returned.load(std::memory_order_relaxed);
+            do
+                b->next = head;
+            while(!returned.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+        }
+    };
+
+    /*
+     * Caches of threads which have exited, never destroyed.
+     */
+    struct parked_caches
+    {
+        std::mutex mutex;
+        cache* head = nullptr;
+
+        cache* adopt()
+        {
+            if(!head)
+                return new cache();
+            return std::exchange(head, head->next_parked);
+        }
+
+        void park(cache* c) noexcept
+        {
+            c->next_parked = head;
+            head = c;
+        }
+    };
+
+    struct cache_handle
+    {
+        constexpr cache_handle() noexcept : owned(nullptr), exited(false) {}
+
+        cache* owned;
+        bool exited;
+
+        ~cache_handle()
+        {
+            if(owned)
+            {
+                auto& p = parked();
+                std::scoped_lock lock(p.mutex);
+                p.park(std::exchange(owned, nullptr));
+            }
+            exited = true;
+        }
+    };
+    inline static thread_local cache_handle t_cache;
+
+    class arena_resource final : public std::pmr::memory_resource
+    {
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override
+        {
+            return task_arena::allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override
+        {
+            task_arena::deallocate(ptr, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    static parked_caches& parked()
+    {
+        // Leaked on purpose, threads may still exit after static destruction.
+        static auto p = new parked_caches();
+        return *p;
+    }
+
+    /*
+     * This thread's cache, a parked one or a new one on first use, null
+     * once the thread is exiting.
+     */
+    static cache* local()
+    {
+        if(t_cache.owned)
+            return t_cache.owned;
+        if(t_cache.exited)
+            return nullptr;
+
+        auto& p = parked();
+        std::scoped_lock lock(p.mutex);
+        return t_cache.owned = p.adopt();
+    }
+
+    static slab* slab_of(void* ptr) noexcept
+    {
+        return reinterpret_cast<slab*>(reinterpret_cast<std::uintptr_t>(ptr) & ~(slab_size - 1));
+    }
+
+    static unsigned int size_class(std::size_t bytes) noexcept
+    {
+        unsigned int c = 0;
+        while((min_block << c) < bytes)
+            ++c;
+        return c;
+    }
+};
@@ -0,0 +1,246 @@
+/*
+ * ------------------------------------------------------------------------
+ * Reusable dependency graph of tasks.
+ *
+ * Nodes and edges are declared up front, then run() submits every node
+ * without predecessors. Each node has an atomic count of predecessors not
+ * yet finished; the task finishing last submits the node, so nothing ever
+ * waits on anything except the caller of wait(). Of the successors a node
+ * releases, one is run right away on the same thread instead of going
+ * through the queues.
+ *
+ * Running again resets the counters in place, no allocation happens after
+ * the first run unless the graph was changed. The first exception thrown
+ * by a node skips every node not yet started and is rethrown by wait().
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <exception>
+#include <condition_variable>
+#include "pool_future.h"
+#include "unique_task.h"
+
+class task_graph
+{
+public:
+    using node = unsigned int;
+
+    task_graph() = default;
+    task_graph(const task_graph&) = delete;
+    task_graph& operator=(const task_graph&) = delete;
+
+    ~task_graph()
+    {
+        wait_idle();
+    }
+
+    template<typename F>
+    node emplace(F&& f)
+    {
+        check_idle();
+        m_nodes.emplace_back(std::forward<F>(f));
+        m_validated = false;
+        return static_cast<node>(m_nodes.size() - 1);
+    }
+
+    /*
+     * to starts only after from has finished.
+     */
+    void precede(node from, node to)
+    {
+        check_idle();
+        if(from >= m_nodes.size() || to >= m_nodes.size() || from == to)
+            throw std::invalid_argument("Invalid task_graph edge!");
+        m_nodes[from].successors.push_back(to);
+        ++m_nodes[to].predecessors;
+        m_validated = false;
+    }
+
+    size_t size() const noexcept
+    {
+        return m_nodes.size();
+    }
+
+    /*
+     * Submits the graph to the pool and returns immediately.
+     */
+    template<typename Pool>
+    void run(Pool& pool)
+    {
+        check_idle();
+        validate();
+
+        m_executor = pool.executor();
+        m_error = nullptr;
+        m_cancelled.store(false, std::memory_order_relaxed);
+        for(auto& n : m_nodes)
+            n.pending.store(n.predecessors, std::memory_order_relaxed);
+
+        if(m_nodes.empty())
+            return;
+
+        {
+            std::scoped_lock lock(m_mutex);
+            m_running = true;
+        }
+        m_remaining.store(static_cast<unsigned int>(m_nodes.size()), std::memory_order_release);
+
+        for(auto root : m_roots)
+            submit(root);
+    }
+
+    /*
+     * Blocks until the last run is over, rethrowing its first exception.
+     */
+    void wait()
+    {
+        wait_idle();
+        if(m_error)
+            std::rethrow_exception(std::exchange(m_error, nullptr));
+    }
+
+    template<typename Pool>
+    void run_and_wait(Pool& pool)
+    {
+        run(pool);
+        wait();
+    }
+
+private:
+    struct vertex
+    {
+        template<typename F>
+        explicit vertex(F&& f) : work(std::forward<F>(f)) {}
+
+        unique_task<void(void)> work;
+        std::vector<node> successors;
+        unsigned int predecessors = 0;
+        std::atomic_uint pending = 0;
+    };
+
+    void check_idle() const
+    {
+        std::scoped_lock lock(m_mutex);
+        if(m_running)
+            throw std::logic_error("task_graph is running!");
+    }
+
+    void wait_idle()
+    {
+        std::unique_lock lock(m_mutex);
+        m_idle.wait(lock, [this]() { return !m_running; });
+    }
+
+    /*
+     * Kahn's algorithm, once per change: collects the roots and rejects
+     * cycles, which would otherwise never finish.
+     */
+    void validate()
+    {
+        if(m_validated)
+            return;
+
+        m_roots.clear();
+        std::vector<unsigned int> pending;
+        std::vector<node> ready;
+        for(node n = 0; n < m_nodes.size(); ++n)
+        {
+            pending.push_back(m_nodes[n].predecessors);
+            if(!m_nodes[n].predecessors)
+            {
+                m_roots.push_back(n);
+                ready.push_back(n);
+            }
+        }
+
+        size_t visited = 0;
+        while(!ready.empty())
+        {
+            const auto n = ready.back();
+            ready.pop_back();
+            ++visited;
+            for(auto s : m_nodes[n].successors)
+                if(!--pending[s])
+                    ready.push_back(s);
+        }
+        if(visited != m_nodes.size())
+            throw std::invalid_argument("task_graph has a cycle!");
+
+        m_validated = true;
+    }
+
+    void submit(node n)
+    {
+        m_executor([this, n]() { execute(n); });
+    }
+
+    void execute(node n)
+    {
+        while(true)
+        {
+            auto& v = m_nodes[n];
+            if(!m_cancelled.load(std::memory_order_relaxed))
+            {
+                try
+                {
+                    v.work();
+                }
+                catch(...)
+                {
+                    std::scoped_lock lock(m_mutex);
+                    if(!m_error)
+                        m_error = std::current_exception();
+                    m_cancelled.store(true, std::memory_order_relaxed);
+                }
+            }
+
+            // Submit every released successor but the last, which we keep.
+            node next = 0;
+            bool keep = false;
+            for(auto s : v.successors)
+                if(m_nodes[s].pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    if(keep)
+                        submit(next);
+                    next = s;
+                    keep = true;
+                }
+
+            finished();
+            if(!keep)
+                return;
+            n = next;
+        }
+    }
+
+    void finished()
+    {
+        if(m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            std::scoped_lock lock(m_mutex);
+            m_running = false;
+            m_idle.notify_all();
+        }
+    }
+
+    // A deque keeps the vertices, and their atomics, in place as it grows.
+    std::deque<vertex> m_nodes;
+    std::vector<node> m_roots;
+    bool m_validated = false;
+
+    task_executor m_executor;
+    alignas(64) std::atomic_uint m_remaining = 0;
+    std::atomic_bool m_cancelled = false;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_idle;
+    bool m_running = false;
+    std::exception_ptr m_error;
+};
@@ -2,174 +2,1212 @@
 
 #include <tuple>
 #include <atomic>
+#include <chrono>
 #include <vector>
+#include <algorithm>
 #include <thread>
+#include <mutex>
 #include <memory>
 #include <future>
 #include <utility>
+#include <optional>
 #include <stdexcept>
 #include <functional>
+#include <condition_variable>
 #include <type_traits>
 #include "queue.h"
 #include "queue2.h"
+#include "affinity.h"
+#include "elastic.h"
+#include "mpmc_ring.h"
+#include "parallel.h"
+#include "pool_stats.h"
+#include "pool_channel.h"
+#include "pool_future.h"
+#include "pool_phase.h"
+#ifdef __linux__
+#include "pool_reactor.h"
+#endif
+#include "segmented_queue.h"
+#include "task_graph.h"
+#include "unique_task.h"
+#include "work_stealing_deque.h"
+#ifdef __cpp_impl_coroutine
+#include "pool_coroutine.h"
+#endif
 
-using thread_pool_proc = std::function<void(void)>;
+using thread_pool_proc = unique_task<void(void)>;
 
-template<template<typename, typename> typename Q=blocking_queue, typename S=fast_semaphore>
+/*
+ * With Stats set every task records its queue wait and run time into the
+ * worker's histograms, see stats(). Without it none of that is compiled in.
+ *
+ * threads workers always run. With scaling.max_threads above that, more
+ * are started while the queue falls behind and exit again once idle, see
+ * elastic.h; the queue then keeps its push and pop counters regardless of
+ * Stats, they are what the supervisor samples.
+ *
+ * wait_idle() waits for everything submitted so far, helping with it, and
+ * pause() and resume() hold the workers between phases without stopping
+ * them, see pool_phase.h.
+ */
+template<typename Q=blocking_queue<thread_pool_proc>, bool Stats=false>
 class simple_thread_pool
 {
 public:
     explicit simple_thread_pool(
-            unsigned int threads = std::thread::hardware_concurrency())
+            unsigned int threads = std::thread::hardware_concurrency(),
+            const worker_scaling& scaling = worker_scaling())
+    : m_workers(threads, scaling)
     {
         if(!threads)
             throw std::invalid_argument("Invalid thread count!");
 
-        auto worker = [this]()
+        if constexpr(Stats)
+            m_workerStats = std::make_unique<worker_stats[]>(m_workers.max() + 1);
+        if(counting())
+            m_queueStats = std::make_unique<queue_stats>();
+
+        auto worker = [this](unsigned int i)
         {
+            t_pool = this;
+            t_index = i;
+            const bool retirable = m_workers.retirable(i);
             while(true)
             {
                 Proc f;
-                if(!m_queue.pop(f))
+                if(!(retirable ? m_queue.pop_for(f, m_workers.idle_timeout()) : m_queue.pop(f)))
                     break;
+                if(counting())
+                    m_queueStats->popped.fetch_add(1, std::memory_order_relaxed);
+                if(m_phase.paused())
+                {
+                    m_phase.hold(f);
+                    if(!f)
+                        continue;
+                }
                 f();
+                m_phase.finished();
             }
+            t_pool = nullptr;
         };
 
-        for(auto i = 0; i < threads; ++i)
-            m_threads.emplace_back(worker);
+        m_workers.start(worker, [this]()
+        {
+            const auto pushed = m_queueStats->pushed.load(std::memory_order_relaxed);
+            const auto popped = m_queueStats->popped.load(std::memory_order_relaxed);
+            return worker_load{ pushed > popped ? pushed - popped : 0, popped };
+        });
     }
 
     ~simple_thread_pool()
     {
+        // Whatever is queued still runs.
+        m_phase.resume();
         m_queue.done();
-
-        for(auto& thread : m_threads)
-            thread.join();
+        m_workers.join();
     }
 
     template<typename F, typename... Args>
     void enqueue_work(F&& f, Args&&... args)
     {
-        m_queue.push([p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() { std::apply(p, t); });
+        push_work(make_proc([p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable { std::apply(p, t); }));
     }
 
+    /*
+     * The returned future's then() continues on this pool.
+     */
     template<typename F, typename... Args>
-    [[nodiscard]] auto enqueue_task(F&& f, Args&&... args) -> std::future<std::invoke_result_t<F, Args...>>
+    [[nodiscard]] auto enqueue_task(F&& f, Args&&... args) -> pool_future<std::invoke_result_t<F, Args...>>
     {
         using task_return_type = std::invoke_result_t<F, Args...>;
-        using task_type = std::packaged_task<task_return_type()>;
 
-        auto task = std::make_shared<task_type>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-        auto result = task->get_future();
+        pool_promise<task_return_type> promise(executor());
+        auto result = promise.get_future();
 
-        m_queue.push([task]() { (*task)(); });
+        push_work(make_proc([promise = std::move(promise), p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable
+        {
+            promise.fulfil([&]() { return std::apply(p, t); });
+        }));
 
         return result;
     }
 
+    /*
+     * Submits through this pool, for continuations and task graphs.
+     */
+    task_executor executor() noexcept
+    {
+        return { this, [](void* pool, thread_pool_proc&& task)
+        {
+            auto self = static_cast<decltype(this)>(pool);
+            self->push_work(self->make_proc(std::move(task)));
+        }};
+    }
+
+#ifdef __cpp_impl_coroutine
+    /*
+     * co_await pool.schedule() resumes the coroutine on a worker of this pool.
+     */
+    schedule_awaitable schedule() noexcept
+    {
+        return schedule_awaitable(executor());
+    }
+#endif
+
+    /*
+     * Runs f on a worker, which f keeps for as long as it runs. f is not
+     * counted as submitted, so wait_idle() does not wait for it, and goes
+     * back to the queues if the caller of wait_idle() takes it.
+     */
+    template<typename F>
+    void lend_worker(F&& f)
+    {
+        enqueue_work([this, f = std::forward<F>(f)]() mutable
+        {
+            if(t_pool == this)
+                f();
+            else
+                lend_worker(std::move(f));
+            // Makes up for the worker's finished().
+            m_phase.submitted();
+        });
+        m_phase.finished();
+    }
+
+    /*
+     * Upper bound of the worker count.
+     */
+    unsigned int threads() const noexcept
+    {
+        return m_workers.max();
+    }
+
+    /*
+     * Workers running right now.
+     */
+    unsigned int running_threads() const noexcept
+    {
+        return m_workers.running();
+    }
+
+    /*
+     * Index of the calling worker in [0, threads()), -1 outside the pool.
+     */
+    int worker_index() const noexcept
+    {
+        return t_pool == this ? static_cast<int>(t_index) : -1;
+    }
+
+    /*
+     * Blocks until every task submitted so far, and everything those
+     * submit in turn, has run, running queued tasks on the calling thread
+     * meanwhile. Not from a task of this pool.
+     */
+    void wait_idle()
+    {
+        if(t_pool == this)
+            throw std::logic_error("wait_idle() called from a task of the pool!");
+        // Stats of the tasks run here go to the slot past the workers'.
+        const auto index = std::exchange(t_index, m_workers.max());
+        m_phase.wait_idle([this](Proc& f)
+        {
+            if(!m_queue.try_pop(f))
+                return false;
+            if(counting())
+                m_queueStats->popped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        });
+        t_index = index;
+    }
+
+    /*
+     * Whether nothing is queued or running right now.
+     */
+    bool idle() const noexcept
+    {
+        return m_phase.idle();
+    }
+
+    /*
+     * Workers finish the task they are running and start no other one until
+     * resume(); submitting still works.
+     */
+    void pause() noexcept
+    {
+        m_phase.pause();
+    }
+
+    void resume() noexcept
+    {
+        m_phase.resume();
+    }
+
+    template<bool S = Stats>
+    std::enable_if_t<S, thread_pool_stats> stats() const
+    {
+        thread_pool_stats result;
+        for(unsigned int i = 0; i <= m_workers.max(); ++i)
+        {
+            const auto& w = m_workerStats[i];
+            result.completed += w.completed.load(std::memory_order_relaxed);
+            w.queue_wait.copy_to(result.queue_wait);
+            w.execution.copy_to(result.execution);
+        }
+        const auto pushed = m_queueStats->pushed.load(std::memory_order_relaxed);
+        const auto popped = m_queueStats->popped.load(std::memory_order_relaxed);
+        result.submitted = pushed;
+        result.queue_depth.push_back(static_cast<std::int64_t>(pushed - popped));
+        return result;
+    }
+
 private:
-    using Proc = std::function<void(void)>;
-    using Queue = Q<Proc, S>;
+    using Proc = thread_pool_proc;
+
+    void push_work(Proc&& work)
+    {
+        m_phase.submitted();
+        if(counting())
+            m_queueStats->pushed.fetch_add(1, std::memory_order_relaxed);
+        m_queue.push(std::move(work));
+    }
+
+    bool counting() const noexcept
+    {
+        return Stats || m_workers.elastic();
+    }
+
+    template<typename F>
+    Proc make_proc(F&& f)
+    {
+        if constexpr(Stats)
+            return Proc([this, stamp = stats_clock::now(), f = std::forward<F>(f)]() mutable
+            {
+                const auto start = stats_clock::now();
+                f();
+                const auto end = stats_clock::now();
+                // Every caller of wait_idle() writes the same slot.
+                std::unique_lock lock(m_helperStats, std::defer_lock);
+                if(t_pool != this)
+                    lock.lock();
+                auto& s = m_workerStats[t_index];
+                s.queue_wait.record(stats_elapsed_ns(stamp, start));
+                s.execution.record(stats_elapsed_ns(start, end));
+                worker_stats::bump(s.completed);
+            });
+        else
+            return Proc(std::forward<F>(f));
+    }
+
+    using Queue = Q;
     Queue m_queue;
 
-    using Threads = std::vector<std::thread>;
-    Threads m_threads;
+    pool_phase m_phase;
+
+    worker_set m_workers;
+
+    std::unique_ptr<worker_stats[]> m_workerStats;
+    std::unique_ptr<queue_stats> m_queueStats;
+    std::mutex m_helperStats;
+
+    inline static thread_local const simple_thread_pool* t_pool = nullptr;
+    inline static thread_local unsigned int t_index = 0;
+};
+
+template<typename T, typename = void>
+struct has_prefault : std::false_type {};
+
+template<typename T>
+struct has_prefault<T, std::void_t<decltype(std::declval<T&>().prefault())>> : std::true_type {};
+
+/*
+ * Lanes of a thread_pool built with lanes > 1, highest first. A pool with
+ * fewer lanes folds the lowest priorities together.
+ */
+enum class task_priority : unsigned int
+{
+    high,
+    normal,
+    low
+};
+
+inline constexpr unsigned int task_priorities = 3;
+
+using task_clock = std::chrono::steady_clock;
+
+struct task_options
+{
+    task_priority priority = task_priority::normal;
+    // A task dequeued after its deadline is not run.
+    task_clock::time_point deadline = task_clock::time_point::max();
 };
 
-template<typename Q=atomic_blocking_queue<thread_pool_proc, fast_semaphore>>
+/*
+ * What the future of a task dropped for its deadline throws.
+ */
+class task_expired : public std::runtime_error
+{
+public:
+    task_expired() : std::runtime_error("Task deadline expired!") {}
+};
+
+/*
+ * Stats works as for simple_thread_pool and additionally counts steals.
+ *
+ * Worker i serves queue i % queues. With affinity_policy::pinned every
+ * worker is pinned to its own CPU. affinity_policy::numa additionally
+ * deals the queues round robin over the NUMA nodes, pins each worker to a
+ * CPU of its queue's node, builds (and prefaults) every queue and deque
+ * while running on its node, and makes submitters try the queues of their
+ * own node before scanning the others.
+ *
+ * Building on a node only places pages touched there for the first time,
+ * nothing is bound explicitly. A ring large enough for malloc to map it
+ * afresh (128 KiB and up with glibc's defaults, or one on huge pages)
+ * lands on its node; a smaller ring, and the queue and deque objects
+ * themselves, may share heap pages first touched elsewhere.
+ *
+ * With lanes > 1 every queue becomes one queue per priority lane. Workers
+ * then scan the lanes highest first and park like work stealing workers
+ * rather than blocking on a single queue. Every AGING-th scan starts at one
+ * of the lower lanes instead, in turn, so a steady stream of urgent work
+ * slows the rest down but never starves it. A task submitted with a
+ * deadline which has passed by the time a worker picks it up is dropped and
+ * counted in expired(); its future, if any, throws task_expired, so the
+ * caller can divert it with then().
+ *
+ * scaling works as for simple_thread_pool. Workers [0, threads) are the
+ * permanent ones, so threads must still cover every queue; an extra worker
+ * i serves queue i % queues like the rest and exits when it has been idle,
+ * blocked on its queue or parked, for the idle timeout.
+ *
+ * reactor() dispatches file descriptor readiness as tasks, polled by an
+ * idle worker in place of parking, see pool_reactor.h.
+ *
+ * wait_idle(), pause() and resume() work as for simple_thread_pool; the
+ * caller of wait_idle() takes from every lane and steals from the deques.
+ * wait_idle() does not wait for a worker lent out with lend_worker(), such
+ * as the one polling the reactor or draining a pool_channel.
+ */
+template<typename Q=atomic_blocking_queue<thread_pool_proc>, bool Stats=false>
 class thread_pool
 {
 public:
     explicit thread_pool(
             unsigned int threads = std::thread::hardware_concurrency(),
-            unsigned int queues = std::thread::hardware_concurrency())
+            unsigned int queues = std::thread::hardware_concurrency(),
+            bool work_stealing = false,
+            affinity_policy affinity = affinity_policy::none,
+            unsigned int lanes = 1,
+            const worker_scaling& scaling = worker_scaling())
     :
-      m_queues(queues),
-      m_count(queues)
+      m_workers(threads, scaling),
+      m_count(queues),
+      m_lanes(lanes),
+      m_normal(std::min(static_cast<unsigned int>(task_priority::normal), lanes - 1)),
+      m_stealing(work_stealing),
+      m_parking(work_stealing || lanes > 1),
+      m_numa(affinity == affinity_policy::numa)
     {
-        if(!threads || threads < queues)
+        if(!threads || !queues || threads < queues)
             throw std::invalid_argument("Invalid thread count!");
+        if(!lanes || lanes > task_priorities)
+            throw std::invalid_argument("Invalid lane count!");
+
+        const auto& nodes = cpu_topology::get().nodes();
+        const auto node_count = m_numa ? std::min<unsigned int>(nodes.size(), queues) : 1u;
+
+        m_nodeQueues.resize(node_count);
+        m_nodeIndex = std::make_unique<node_index[]>(node_count);
+        for(unsigned int q = 0; q < queues; ++q)
+        {
+            m_queueNode.push_back(q % node_count);
+            m_nodeQueues[q % node_count].push_back(q);
+        }
 
-        auto worker = [this](auto i)
+        // Own queue first, then the rest of its node, then everything else.
+        m_scan.resize(queues);
+        for(unsigned int q = 0; q < queues; ++q)
         {
-            set_thr_id(i);
+            for(unsigned int n = 0; n < queues; ++n)
+                if(m_queueNode[(q + n) % queues] == m_queueNode[q])
+                    m_scan[q].push_back((q + n) % queues);
+            for(unsigned int n = 0; n < queues; ++n)
+                if(m_queueNode[(q + n) % queues] != m_queueNode[q])
+                    m_scan[q].push_back((q + n) % queues);
+        }
+
+        // Lane l of queue q is m_queues[l * queues + q].
+        for(unsigned int l = 0; l < lanes; ++l)
+            for(unsigned int q = 0; q < queues; ++q)
+            {
+                std::optional<node_scope> scope;
+                if(m_numa)
+                    scope.emplace(m_queueNode[q]);
+                m_queues.emplace_back(std::make_unique<Q>());
+                if constexpr(has_prefault<Q>::value)
+                    if(m_numa)
+                        m_queues.back()->prefault();
+            }
+
+        const auto workers = m_workers.max();
+        if(m_stealing)
+            for(unsigned int i = 0; i < workers; ++i)
+            {
+                std::optional<node_scope> scope;
+                if(m_numa)
+                    scope.emplace(m_queueNode[i % queues]);
+                m_deques.emplace_back(std::make_unique<Deque>());
+            }
+
+        // Worker i gets the next unused CPU of its node, or of the whole
+        // machine when merely pinned, taking the nodes in turn.
+        std::vector<int> cpus(workers, -1);
+        if(affinity != affinity_policy::none)
+        {
+            size_t widest = 0;
+            for(const auto& node : nodes)
+                widest = std::max(widest, node.size());
+            std::vector<unsigned int> all;
+            for(size_t k = 0; k < widest; ++k)
+                for(const auto& node : nodes)
+                    if(k < node.size())
+                        all.push_back(node[k]);
+            std::vector<unsigned int> used(nodes.size(), 0);
+            for(unsigned int i = 0; i < workers; ++i)
+            {
+                if(m_numa)
+                {
+                    const auto& node = nodes[m_queueNode[i % queues]];
+                    cpus[i] = node[used[m_queueNode[i % queues]]++ % node.size()];
+                }
+                else
+                    cpus[i] = all[i % all.size()];
+            }
+        }
+
+        if constexpr(Stats)
+            m_workerStats = std::make_unique<worker_stats[]>(workers + 1);
+        if(counting())
+            m_queueStats = std::make_unique<queue_stats[]>(m_queues.size());
+
+        auto worker = [this, cpus = std::move(cpus)](unsigned int i)
+        {
+            const auto q = i % m_count;
+            if(cpus[i] >= 0)
+                cpu_topology::pin(cpus[i]);
+            t_pool = this;
+            t_index = i;
+            t_node = m_queueNode[q];
             while(true)
             {
                 thread_pool_proc f;
-                for(auto n = 0; n < m_count * K; ++n)
+                if(m_parking)
                 {
-                    if(m_queues[(i + n) % m_count].try_pop(f))
-                    {
+                    if(!acquire_work(i, q, f))
                         break;
-                    }
                 }
-                if(!f)
+                else
                 {
-                    m_queues[i].pop(f);
+                    const auto& scan = m_scan[q];
+                    for(unsigned int n = 0; n < m_count * K; ++n)
+                    {
+                        if(m_queues[scan[n % m_count]]->try_pop(f))
+                        {
+                            popped(scan[n % m_count]);
+                            break;
+                        }
+                    }
+                    if(!f)
+                    {
+                        if(m_workers.retirable(i))
+                            m_queues[q]->pop_for(f, m_workers.idle_timeout());
+                        else
+                            m_queues[q]->pop(f);
+                        if(f)
+                            popped(q);
+                    }
+                    if (!f)
+                        break;
                 }
-                if (!f)
-                    break;
 
-                f();
+                run_work(f);
             }
-            std::cout << std::this_thread::get_id() << "Thread " << i << " exited." << std::endl;
+            t_pool = nullptr;
+            std::cout << std::this_thread::get_id() << "Thread " << q << " exited." << std::endl;
         };
 
-        for(auto i = 0; i < threads; ++i)
-            m_threads.emplace_back(worker, i % queues);
+        m_workers.start(std::move(worker), [this]()
+        {
+            worker_load load;
+            for(size_t i = 0; i < m_queues.size(); ++i)
+            {
+                const auto pushed = m_queueStats[i].pushed.load(std::memory_order_relaxed);
+                const auto popped = m_queueStats[i].popped.load(std::memory_order_relaxed);
+                load.queued += pushed > popped ? pushed - popped : 0;
+                load.dequeued += popped;
+            }
+            for(const auto& deque : m_deques)
+                load.queued += deque->size();
+            return load;
+        });
     }
 
     ~thread_pool()
     {
+        // Whatever is queued still runs.
+        m_phase.resume();
+#ifdef __linux__
+        if(auto reactor = m_reactor.load(std::memory_order_acquire); reactor && !m_parking)
+            reactor->stop();
+#endif
+        if(m_parking)
+        {
+            {
+                std::scoped_lock lock(m_idleMutex);
+                m_done = true;
+            }
+            m_idle.notify_all();
+#ifdef __linux__
+            if(auto reactor = m_reactor.load(std::memory_order_acquire))
+                reactor->notify();
+#endif
+        }
         for(auto& queue : m_queues)
-            queue.done();
-        for(auto& thread : m_threads)
-            thread.join();
+            queue->done();
+        m_workers.join();
     }
 
     template<typename F, typename... Args>
     void enqueue_work(F&& f, Args&&... args)
     {
-        thread_pool_proc work = [p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() { std::apply(p, t); };
-        auto i = m_index++;
+        push_work(make_proc([p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable { std::apply(p, t); }));
+    }
 
-        for(auto n = 0; n < m_count * K; ++n)
-            if(m_queues[(i + n) % m_count].try_push(std::move(work)))
-                return;
+    template<typename F, typename... Args>
+    void enqueue_work(task_priority priority, F&& f, Args&&... args)
+    {
+        push_work(make_proc([p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable { std::apply(p, t); }), priority);
+    }
+
+    template<typename F, typename... Args>
+    void enqueue_work(task_options options, F&& f, Args&&... args)
+    {
+        push_work(make_proc([this, deadline = options.deadline, p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable
+        {
+            if(!expired(deadline))
+                std::apply(p, t);
+        }), options.priority);
+    }
+
+    /*
+     * The returned future's then() continues on this pool.
+     */
+    template<typename F, typename... Args>
+    [[nodiscard]] auto enqueue_task(F&& f, Args&&... args) -> pool_future<std::invoke_result_t<F, Args...>>
+    {
+        return enqueue_task(task_options(), std::forward<F>(f), std::forward<Args>(args)...);
+    }
 
-        m_queues[i % m_count].push(std::move(work));
+    template<typename F, typename... Args>
+    [[nodiscard]] auto enqueue_task(task_priority priority, F&& f, Args&&... args) -> pool_future<std::invoke_result_t<F, Args...>>
+    {
+        return enqueue_task(task_options{ priority }, std::forward<F>(f), std::forward<Args>(args)...);
     }
 
     template<typename F, typename... Args>
-    [[nodiscard]] auto enqueue_task(F&& f, Args&&... args) -> std::future<std::invoke_result_t<F, Args...>>
+    [[nodiscard]] auto enqueue_task(task_options options, F&& f, Args&&... args) -> pool_future<std::invoke_result_t<F, Args...>>
     {
         using task_return_type = std::invoke_result_t<F, Args...>;
-        using task_type = std::packaged_task<task_return_type()>;
 
-        auto task = std::make_shared<task_type>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-        auto work = [task]() { (*task)(); };
-        auto result = task->get_future();
-        auto i = m_index++;
+        pool_promise<task_return_type> promise(executor());
+        auto result = promise.get_future();
+
+        push_work(make_proc([this, deadline = options.deadline, promise = std::move(promise), p = std::forward<F>(f), t = std::make_tuple(std::forward<Args>(args)...)]() mutable
+        {
+            if(expired(deadline))
+                promise.fail(std::make_exception_ptr(task_expired()));
+            else
+                promise.fulfil([&]() { return std::apply(p, t); });
+        }), options.priority);
+
+        return result;
+    }
+
+    /*
+     * Submits through this pool, for continuations and task graphs.
+     */
+    task_executor executor() noexcept
+    {
+        return { this, [](void* pool, thread_pool_proc&& task)
+        {
+            auto self = static_cast<decltype(this)>(pool);
+            self->push_work(self->make_proc(std::move(task)));
+        }};
+    }
+
+#ifdef __cpp_impl_coroutine
+    /*
+     * co_await pool.schedule() resumes the coroutine on a worker of this pool.
+     */
+    schedule_awaitable schedule() noexcept
+    {
+        return schedule_awaitable(executor());
+    }
+#endif
+
+    /*
+     * Runs f on a worker, which f keeps for as long as it runs. f is not
+     * counted as submitted, so wait_idle() does not wait for it, and goes
+     * back to the queues if the caller of wait_idle() takes it.
+     */
+    template<typename F>
+    void lend_worker(F&& f)
+    {
+        enqueue_work([this, f = std::forward<F>(f)]() mutable
+        {
+            if(t_pool == this)
+                f();
+            else
+                lend_worker(std::move(f));
+            // Makes up for the worker's finished().
+            m_phase.submitted();
+        });
+        m_phase.finished();
+    }
+
+#ifdef __linux__
+    /*
+     * The pool's epoll reactor, created on first use. Parking workers poll
+     * it while idle, otherwise it takes one worker for good, see
+     * pool_reactor.h.
+     */
+    pool_reactor& reactor()
+    {
+        std::call_once(m_reactorOnce, [this]()
+        {
+            m_reactorOwner = std::make_unique<pool_reactor>(executor());
+            m_reactor.store(m_reactorOwner.get(), std::memory_order_release);
+            // Lend a worker, or wake a parked one which would otherwise only
+            // start polling after its timeout.
+            if(!m_parking)
+                lend_worker([this, reactor = m_reactorOwner.get()]() { poll_reactor(*reactor); });
+            else
+                wake(1);
+        });
+        return *m_reactorOwner;
+    }
+#endif
+
+    /*
+     * Moves the callables in [first, last) into the pool in batches of B,
+     * each batch handed to one queue with a single push_bulk.
+     */
+    template<typename It>
+    void enqueue_bulk(It first, It last)
+    {
+        thread_pool_proc batch[B];
+
+        while(first != last)
+        {
+            unsigned int n = 0;
+            for(; n < B && first != last; ++n, ++first)
+                batch[n] = make_proc(std::move(*first));
+            m_phase.submitted(n);
 
-        for(auto n = 0; n < m_count * K; ++n)
-            if(m_queues[(i + n) % m_count].try_push(std::move(work)))
-                return result;
+            const auto node = submit_node();
+            const auto& local = m_nodeQueues[node];
+            const auto i = m_normal * m_count + local[m_nodeIndex[node].value++ % local.size()];
+            auto& queue = *m_queues[i];
+            if(counting())
+                m_queueStats[i].pushed.fetch_add(n, std::memory_order_relaxed);
+            for(unsigned int pushed = 0; pushed < n; )
+            {
+                auto count = queue.push_bulk(batch + pushed, batch + n);
+                if(!count)
+                {
+                    m_phase.finished(n - pushed);
+                    return;
+                }
+                pushed += count;
+            }
+            signal(i, n);
+        }
+    }
 
-        m_queues[i % m_count].push(std::move(work));
+    /*
+     * Upper bound of the worker count.
+     */
+    unsigned int threads() const noexcept
+    {
+        return m_workers.max();
+    }
 
+    /*
+     * Workers running right now.
+     */
+    unsigned int running_threads() const noexcept
+    {
+        return m_workers.running();
+    }
+
+    /*
+     * Index of the calling worker in [0, threads()), -1 outside the pool.
+     */
+    int worker_index() const noexcept
+    {
+        return t_pool == this ? static_cast<int>(t_index) : -1;
+    }
+
+    /*
+     * Blocks until every task submitted so far, and everything those
+     * submit in turn, has run, running queued tasks on the calling thread
+     * meanwhile. Not from a task of this pool.
+     */
+    void wait_idle()
+    {
+        if(t_pool == this)
+            throw std::logic_error("wait_idle() called from a task of the pool!");
+        // Stats of the tasks run here go to the slot past the workers'.
+        const auto index = std::exchange(t_index, m_workers.max());
+        m_phase.wait_idle([this](thread_pool_proc& f) { return try_take_work(f); });
+        t_index = index;
+    }
+
+    /*
+     * Whether nothing is queued or running right now.
+     */
+    bool idle() const noexcept
+    {
+        return m_phase.idle();
+    }
+
+    /*
+     * Workers finish the task they are running and start no other one until
+     * resume(); submitting still works.
+     */
+    void pause() noexcept
+    {
+        m_phase.pause();
+    }
+
+    void resume() noexcept
+    {
+        m_phase.resume();
+    }
+
+    /*
+     * Number of tasks dropped for their deadline so far.
+     */
+    std::uint64_t expired() const noexcept
+    {
+        return m_expired.load(std::memory_order_relaxed);
+    }
+
+    template<bool S = Stats>
+    std::enable_if_t<S, thread_pool_stats> stats() const
+    {
+        thread_pool_stats result;
+        for(unsigned int i = 0; i <= m_workers.max(); ++i)
+        {
+            const auto& w = m_workerStats[i];
+            result.completed += w.completed.load(std::memory_order_relaxed);
+            result.steals += w.steals.load(std::memory_order_relaxed);
+            result.submitted += w.local_pushes.load(std::memory_order_relaxed);
+            w.queue_wait.copy_to(result.queue_wait);
+            w.execution.copy_to(result.execution);
+        }
+        result.queue_depth.assign(m_count, 0);
+        for(size_t i = 0; i < m_queues.size(); ++i)
+        {
+            const auto pushed = m_queueStats[i].pushed.load(std::memory_order_relaxed);
+            const auto popped = m_queueStats[i].popped.load(std::memory_order_relaxed);
+            result.submitted += pushed;
+            result.queue_depth[i % m_count] += static_cast<std::int64_t>(pushed - popped);
+        }
+        result.expired = expired();
         return result;
     }
 
 private:
-    using Queues = std::vector<Q>;
+    /*
+     * Work submitted by one of our own workers goes to the LIFO end of its
+     * deque, which counts as part of the normal lane, anything else (or an
+     * overflowing deque) to the shared queues of its lane.
+     */
+    void push_work(thread_pool_proc&& work, task_priority priority = task_priority::normal)
+    {
+        m_phase.submitted();
+        const auto lane = std::min(static_cast<unsigned int>(priority), m_lanes - 1);
+        if(m_stealing && lane == m_normal && t_pool == this && m_deques[t_index]->push(std::move(work)))
+        {
+            if constexpr(Stats)
+                worker_stats::bump(m_workerStats[t_index].local_pushes);
+            wake(1);
+            return;
+        }
+
+        const auto node = submit_node();
+        const auto& local = m_nodeQueues[node];
+        const auto size = static_cast<unsigned int>(local.size());
+        const auto i = m_nodeIndex[node].value++;
+
+        const auto base = lane * m_count;
+
+        auto try_push = [this, &work, base](unsigned int q)
+        {
+            if(!m_queues[base + q]->try_push(std::move(work)))
+                return false;
+            pushed(base + q);
+            signal(base + q, 1);
+            return true;
+        };
+
+        for(unsigned int n = 0; n < size * K; ++n)
+            if(try_push(local[(i + n) % size]))
+                return;
+
+        // Only when every queue of our node is full or contended.
+        if(m_nodeQueues.size() > 1)
+            for(unsigned int n = 0; n < m_count; ++n)
+                if(m_queueNode[(i + n) % m_count] != node && try_push((i + n) % m_count))
+                    return;
+
+        m_queues[base + local[i % size]]->push(std::move(work));
+        pushed(base + local[i % size]);
+        signal(base + local[i % size], 1);
+    }
+
+    /*
+     * After n tasks went to queue i: wakes parked workers, or the worker
+     * lent to the reactor if i is its queue, which it only looks at between
+     * polls.
+     */
+    void signal(unsigned int i, unsigned int n)
+    {
+        if(m_parking)
+            wake(n);
+#ifdef __linux__
+        else if(i == m_lentQueue.load(std::memory_order_acquire))
+            m_reactor.load(std::memory_order_relaxed)->notify();
+#endif
+    }
+
+#ifdef __linux__
+    /*
+     * run() for a worker which other workers do not cover: the ones of its
+     * queue are blocked on it, so it takes what arrives there between polls.
+     */
+    void poll_reactor(pool_reactor& reactor)
+    {
+        const auto q = t_index % m_count;
+        m_lentQueue.store(q, std::memory_order_release);
+        while(!reactor.stopped())
+        {
+            reactor.poll(10);
+            thread_pool_proc f;
+            while(!reactor.stopped() && m_queues[q]->try_pop(f))
+            {
+                popped(q);
+                run_work(f);
+                f = thread_pool_proc();
+            }
+        }
+    }
+#endif
+
+    /*
+     * Runs f unless the pool is paused, in which case f waits for resume()
+     * or is taken over by wait_idle().
+     */
+    void run_work(thread_pool_proc& f)
+    {
+        if(m_phase.paused())
+        {
+            m_phase.hold(f);
+            if(!f)
+                return;
+        }
+        f();
+        m_phase.finished();
+    }
+
+    /*
+     * The node of a worker's queue, else the node the caller runs on now.
+     */
+    unsigned int submit_node() const noexcept
+    {
+        if(m_nodeQueues.size() == 1)
+            return 0;
+        if(t_pool == this)
+            return t_node;
+        return cpu_topology::get().current_node() % m_nodeQueues.size();
+    }
+
+    bool expired(task_clock::time_point deadline) noexcept
+    {
+        if(deadline == task_clock::time_point::max() || task_clock::now() <= deadline)
+            return false;
+        m_expired.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    template<typename F>
+    thread_pool_proc make_proc(F&& f)
+    {
+        if constexpr(Stats)
+            return thread_pool_proc([this, stamp = stats_clock::now(), f = std::forward<F>(f)]() mutable
+            {
+                const auto start = stats_clock::now();
+                f();
+                const auto end = stats_clock::now();
+                // Every caller of wait_idle() writes the same slot.
+                std::unique_lock lock(m_helperStats, std::defer_lock);
+                if(t_pool != this)
+                    lock.lock();
+                auto& s = m_workerStats[t_index];
+                s.queue_wait.record(stats_elapsed_ns(stamp, start));
+                s.execution.record(stats_elapsed_ns(start, end));
+                worker_stats::bump(s.completed);
+            });
+        else
+            return thread_pool_proc(std::forward<F>(f));
+    }
+
+    /*
+     * Queue counters are kept for stats() and for the scaling supervisor.
+     */
+    bool counting() const noexcept
+    {
+        return Stats || m_workers.elastic();
+    }
+
+    void pushed(unsigned int queue) noexcept
+    {
+        if(counting())
+            m_queueStats[queue].pushed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void popped(unsigned int queue) noexcept
+    {
+        if(counting())
+            m_queueStats[queue].popped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool try_acquire_work(unsigned int i, unsigned int q, thread_pool_proc& f, unsigned int& seed, unsigned int& turn)
+    {
+        // Highest lane first, but every AGING-th time start at a lower one.
+        unsigned int first = 0;
+        if(m_lanes > 1 && ++turn % AGING == 0)
+            first = 1 + (turn / AGING) % (m_lanes - 1);
+
+        for(unsigned int l = 0; l < m_lanes; ++l)
+        {
+            const auto lane = (first + l) % m_lanes;
+            if(m_stealing && lane == m_normal && m_deques[i]->pop(f))
+                return true;
+
+            const auto base = lane * m_count;
+            for(unsigned int n = 0; n < m_count; ++n)
+                if(m_queues[base + m_scan[q][n]]->try_pop(f))
+                {
+                    popped(base + m_scan[q][n]);
+                    return true;
+                }
+        }
+
+        if(!m_stealing)
+            return false;
+
+        const auto victims = static_cast<unsigned int>(m_deques.size());
+        if(victims < 2)
+            return false;
+
+        // xorshift32, start at a random victim and visit every other deque once.
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        const auto start = seed % victims;
+        for(unsigned int n = 0; n < victims; ++n)
+        {
+            const auto v = (start + n) % victims;
+            if(v != i && m_deques[v]->steal(f))
+            {
+                if constexpr(Stats)
+                    worker_stats::bump(m_workerStats[i].steals);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * try_acquire_work() for a thread outside the pool: every lane of every
+     * queue, then every deque.
+     */
+    bool try_take_work(thread_pool_proc& f)
+    {
+        for(size_t i = 0; i < m_queues.size(); ++i)
+            if(m_queues[i]->try_pop(f))
+            {
+                popped(static_cast<unsigned int>(i));
+                return true;
+            }
+        for(auto& deque : m_deques)
+            if(deque->steal(f))
+                return true;
+        return false;
+    }
+
+    bool acquire_work(unsigned int i, unsigned int q, thread_pool_proc& f)
+    {
+        thread_local unsigned int seed = i + 1;
+        thread_local unsigned int turn = 0;
+        task_clock::time_point idle_since;
+
+        while(true)
+        {
+            if(try_acquire_work(i, q, f, seed, turn))
+                return true;
+
+            // Announce ourselves before the final check so a concurrent
+            // push either sees us sleeping or is seen by the check.
+            m_sleeping.fetch_add(1);
+            if(try_acquire_work(i, q, f, seed, turn))
+            {
+                m_sleeping.fetch_sub(1);
+                return true;
+            }
+
+            std::unique_lock lock(m_idleMutex);
+            if(m_done)
+            {
+                m_sleeping.fetch_sub(1);
+                lock.unlock();
+                // Drain whatever is still reachable before exiting.
+                return try_acquire_work(i, q, f, seed, turn);
+            }
+            if(m_workers.retirable(i) && !m_wakeups)
+            {
+                const auto now = task_clock::now();
+                if(idle_since == task_clock::time_point())
+                    idle_since = now;
+                else if(now - idle_since >= m_workers.idle_timeout())
+                {
+                    m_sleeping.fetch_sub(1);
+                    lock.unlock();
+                    // Retire, unless something came in meanwhile.
+                    return try_acquire_work(i, q, f, seed, turn);
+                }
+            }
+#ifdef __linux__
+            // One permanent worker sleeps in epoll_wait rather than on m_idle.
+            auto reactor = m_reactor.load(std::memory_order_acquire);
+            if(reactor && !m_polling && !m_wakeups && !m_workers.retirable(i))
+            {
+                m_polling = true;
+                lock.unlock();
+                epoll_event events[pool_reactor::max_events];
+                const auto n = reactor->wait(events, pool_reactor::max_events, 10);
+                lock.lock();
+                m_polling = false;
+                if(m_wakeups)
+                    --m_wakeups;
+                lock.unlock();
+                m_sleeping.fetch_sub(1);
+                // Lands on our own deque when stealing, to be run next.
+                reactor->dispatch(events, n);
+                continue;
+            }
+#endif
+            // The timeout only guards against try_pop failing spuriously on a
+            // contended blocking_queue, regular wake ups come from wake().
+            m_idle.wait_for(lock, std::chrono::milliseconds(10), [this]() { return m_wakeups != 0 || m_done; });
+            if(m_wakeups)
+                --m_wakeups;
+            m_sleeping.fetch_sub(1);
+        }
+    }
+
+    void wake(unsigned int n)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const auto sleeping = m_sleeping.load(std::memory_order_relaxed);
+        if(!sleeping)
+            return;
+        bool poller = false;
+        {
+            std::scoped_lock lock(m_idleMutex);
+            m_wakeups = std::min(m_wakeups + n, sleeping);
+            // The polling worker does not hear m_idle, kick it once the
+            // others do not cover every wake up.
+            poller = m_polling && m_wakeups >= sleeping;
+        }
+        if(n == 1)
+            m_idle.notify_one();
+        else
+            m_idle.notify_all();
+#ifdef __linux__
+        if(poller)
+            m_reactor.load(std::memory_order_relaxed)->notify();
+#endif
+    }
+
+    // Held by pointer so each queue can be allocated on its own node.
+    using Queues = std::vector<std::unique_ptr<Q>>;
     Queues m_queues;
 
-    using Threads = std::vector<std::thread>;
-    Threads m_threads;
+    using Deque = work_stealing_deque<thread_pool_proc>;
+    using Deques = std::vector<std::unique_ptr<Deque>>;
+    Deques m_deques;
 
-    std::atomic_uint m_index = 0;
+    worker_set m_workers;
+
+    // Round robin submission counter of every node, on its own line.
+    struct alignas(64) node_index
+    {
+        std::atomic_uint value = 0;
+    };
+    std::unique_ptr<node_index[]> m_nodeIndex;
+
+    std::vector<std::vector<unsigned int>> m_nodeQueues;
+    std::vector<unsigned int> m_queueNode;
+    std::vector<std::vector<unsigned int>> m_scan;
 
     const unsigned int m_count;
+    const unsigned int m_lanes;
+    const unsigned int m_normal;
+    const bool m_stealing;
+    const bool m_parking;
+    const bool m_numa;
     inline static const unsigned int K = 2;
+    inline static const unsigned int B = 64;
+    inline static const unsigned int AGING = 8;
+
+    std::atomic<std::uint64_t> m_expired = 0;
+
+    pool_phase m_phase;
+
+    alignas(64) std::atomic_uint m_sleeping = 0;
+    unsigned int m_wakeups = 0;
+    bool m_done = false;
+    bool m_polling = false;
+    std::mutex m_idleMutex;
+    std::condition_variable m_idle;
+
+#ifdef __linux__
+    std::once_flag m_reactorOnce;
+    std::atomic<pool_reactor*> m_reactor = nullptr;
+    std::unique_ptr<pool_reactor> m_reactorOwner;
+    // Queue of the worker lent to the reactor, if any.
+    std::atomic_uint m_lentQueue = ~0u;
+#endif
+
+    std::unique_ptr<worker_stats[]> m_workerStats;
+    std::unique_ptr<queue_stats[]> m_queueStats;
+    std::mutex m_helperStats;
+
+    inline static thread_local const thread_pool* t_pool = nullptr;
+    inline static thread_local unsigned int t_index = 0;
+    inline static thread_local unsigned int t_node = 0;
 };
@@ -0,0 +1,189 @@
+/*
+ * Move-only type erased callable with an inline buffer.
+ *
+ * Callables up to N bytes (with fundamental alignment and a noexcept move
+ * constructor) are stored in place, bigger ones in the task arena (see
+ * task_arena.h). The default N keeps sizeof(unique_task) at one cache line.
+ */
+#pragma once
+
+#include <new>
+#include <cstddef>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include "task_arena.h"
+
+template<typename Signature, std::size_t N = 56>
+class unique_task;
+
+template<typename R, typename... Args, std::size_t N>
+class unique_task<R(Args...), N>
+{
+public:
+    unique_task() noexcept = default;
+
+    unique_task(std::nullptr_t) noexcept {}
+
+    template<typename F,
+             typename D = std::decay_t<F>,
+             typename = std::enable_if_t<
+                 !std::is_same<D, unique_task>::value &&
+                 std::is_invocable_r<R, D&, Args...>::value>>
+    unique_task(F&& f)
+    {
+        if constexpr(stored_locally<D>())
+        {
+            new (m_storage) D (std::forward<F>(f));
+            m_ops = &local_ops<D>;
+        }
+        else
+        {
+            auto p = task_arena::allocate(sizeof(D), alignof(D));
+            try
+            {
+                new (m_storage) D* (new (p) D (std::forward<F>(f)));
+            }
+            catch(...)
+            {
+                task_arena::deallocate(p, sizeof(D), alignof(D));
+                throw;
+            }
+            m_ops = &remote_ops<D>;
+        }
+    }
+
+    unique_task(unique_task&& other) noexcept
+    {
+        steal(other);
+    }
+
+    unique_task& operator=(unique_task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            steal(other);
+        }
+        return *this;
+    }
+
+    unique_task& operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    unique_task(const unique_task&) = delete;
+    unique_task& operator=(const unique_task&) = delete;
+
+    ~unique_task() noexcept
+    {
+        reset();
+    }
+
+    R operator()(Args... args)
+    {
+        if(!m_ops)
+            throw std::bad_function_call();
+        return m_ops->invoke(m_storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return m_ops != nullptr;
+    }
+
+    void swap(unique_task& other) noexcept
+    {
+        unique_task tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    void reset() noexcept
+    {
+        if(m_ops)
+        {
+            m_ops->destroy(m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    static constexpr std::size_t capacity() noexcept
+    {
+        return N;
+    }
+
+    template<typename F>
+    static constexpr bool stored_locally() noexcept
+    {
+        return sizeof(F) <= N &&
+               alignof(F) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible<F>::value;
+    }
+
+private:
+    struct ops
+    {
+        R (*invoke)(void*, Args&&...);
+        void (*move)(void* from, void* to) noexcept;
+        void (*destroy)(void*) noexcept;
+    };
+
+    template<typename F>
+    inline static const ops local_ops =
+    {
+        [](void* p, Args&&... args) -> R
+        {
+            return std::invoke(*static_cast<F*>(p), std::forward<Args>(args)...);
+        },
+        [](void* from, void* to) noexcept
+        {
+            new (to) F (std::move(*static_cast<F*>(from)));
+            static_cast<F*>(from)->~F();
+        },
+        [](void* p) noexcept
+        {
+            static_cast<F*>(p)->~F();
+        }
+    };
+
+    template<typename F>
+    inline static const ops remote_ops =
+    {
+        [](void* p, Args&&... args) -> R
+        {
+            return std::invoke(**static_cast<F**>(p), std::forward<Args>(args)...);
+        },
+        [](void* from, void* to) noexcept
+        {
+            new (to) F* (*static_cast<F**>(from));
+        },
+        [](void* p) noexcept
+        {
+            auto f = *static_cast<F**>(p);
+            f->~F();
+            task_arena::deallocate(f, sizeof(F), alignof(F));
+        }
+    };
+
+    void steal(unique_task& other) noexcept
+    {
+        if(other.m_ops)
+        {
+            other.m_ops->move(other.m_storage, m_storage);
+            m_ops = other.m_ops;
+            other.m_ops = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char m_storage[N];
+    const ops* m_ops = nullptr;
+};
+
+template<typename Signature, std::size_t N>
+inline void swap(unique_task<Signature, N>& a, unique_task<Signature, N>& b) noexcept
+{
+    a.swap(b);
+}
@@ -0,0 +1,120 @@
+/*
+ * ------------------------------------------------------------------------
+ * How a thread waits for another one: the W policy of the rings, of
+ * segmented_queue and of the fast and futex semaphores.
+ *
+ * A waiting loop makes one W per wait and backs off with it between two
+ * failed attempts. The rings only ever wait for another thread to finish
+ * with one slot, so they call pause(), which always backs off. The
+ * semaphores call spin() instead, which returns false rather than backing
+ * off once the waiter should go to sleep in the kernel; with a policy
+ * which never parks they spin until they get a count, are done or time
+ * out.
+ *
+ * busy_spin_wait      spins flat out, for isolated cores.
+ * backoff_wait        pauses 1, 2, 4, ... 64 times, then yields.
+ * yield_wait          yields the CPU every time.
+ * spin_then_park_wait spins SPINS times, then parks (yields in a ring);
+ *                     spin_then_park_wait<0> parks straight away.
+ *
+ * The rings default to yield_wait, fast_semaphore and futex_semaphore to
+ * spin_then_park_wait<10000>, which is what they did before.
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+/*
+ * The CPU's spin loop hint, tells a hyperthread sibling to go ahead.
+ */
+inline void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+struct busy_spin_wait
+{
+    void pause() noexcept
+    {
+        // Keeps the compiler from collapsing the loop.
+        std::atomic_signal_fence(std::memory_order_acquire);
+    }
+
+    bool spin() noexcept
+    {
+        pause();
+        return true;
+    }
+};
+
+class backoff_wait
+{
+public:
+    static constexpr unsigned int max_pauses = 64;
+
+    void pause() noexcept
+    {
+        if(m_pauses > max_pauses)
+        {
+            std::this_thread::yield();
+            return;
+        }
+        for(unsigned int i = 0; i < m_pauses; ++i)
+            cpu_relax();
+        m_pauses <<= 1;
+    }
+
+    bool spin() noexcept
+    {
+        pause();
+        return true;
+    }
+
+private:
+    unsigned int m_pauses = 1;
+};
+
+struct yield_wait
+{
+    void pause() noexcept
+    {
+        std::this_thread::yield();
+    }
+
+    bool spin() noexcept
+    {
+        pause();
+        return true;
+    }
+};
+
+template<unsigned int SPINS = 10000>
+class spin_then_park_wait
+{
+public:
+    void pause() noexcept
+    {
+        if(!spin())
+            std::this_thread::yield();
+    }
+
+    bool spin() noexcept
+    {
+        if(m_spins == SPINS)
+            return false;
+        ++m_spins;
+        std::atomic_signal_fence(std::memory_order_acquire);
+        return true;
+    }
+
+private:
+    unsigned int m_spins = 0;
+};
@@ -0,0 +1,160 @@
+/*
+ * ------------------------------------------------------------------------
+ * Bounded single-owner work-stealing deque.
+ *
+ * The owner thread pushes and pops at the bottom (LIFO) using only plain
+ * loads and release stores; any other thread steals from the top (FIFO)
+ * with a single CAS. When the deque is full push() fails and the caller is
+ * expected to fall back to a shared queue.
+ *
+ * Unlike the original algorithm a thief reads the slot only after winning
+ * the CAS on top, so non trivially copyable items are never copied while
+ * being overwritten. Every slot carries a busy flag which keeps the owner
+ * from reusing it until the thief has moved the item out.
+ *
+ * 1. D.Chase, Y.Lev, "Dynamic Circular Work-Stealing Deque"
+ * 2. N.M.Le, A.Pop, A.Cohen, F.Zappa Nardelli, "Correct and Efficient
+ *    Work-Stealing for Weak Memory Models"
+ * ------------------------------------------------------------------------
+ */
+#pragma once
+
+#include <new>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+
+template<typename T,
+         unsigned long Q_SIZE = 4096ul>
+class work_stealing_deque
+{
+public:
+    static_assert(Q_SIZE && !(Q_SIZE & (Q_SIZE - 1)), "Q_SIZE must be a power of two!");
+    static constexpr unsigned long Q_MASK = Q_SIZE - 1;
+
+    explicit work_stealing_deque()
+    :
+      m_top(0),
+      m_bottom(0),
+      m_data(
+          reinterpret_cast<Slot*>(
+              ::operator new(sizeof(Slot) * Q_SIZE,
+                             std::align_val_t(alignof(Slot) > 64 ? alignof(Slot) : 64))))
+    {
+        for(unsigned long i = 0; i < Q_SIZE; ++i)
+            new (&m_data[i].busy) std::atomic_bool(false);
+    }
+
+    work_stealing_deque(const work_stealing_deque&) = delete;
+    work_stealing_deque& operator=(const work_stealing_deque&) = delete;
+
+    ~work_stealing_deque() noexcept
+    {
+        for(auto i = m_top.load(); i < m_bottom.load(); ++i)
+            m_data[i & Q_MASK].item()->~T();
+        ::operator delete(m_data, std::align_val_t(alignof(Slot) > 64 ? alignof(Slot) : 64));
+    }
+
+    /*
+     * Owner only. Leaves item untouched and returns false when full.
+     */
+    bool push(T&& item) noexcept
+    {
+        static_assert(std::is_nothrow_move_constructible<T>::value, "T must be nothrow move constructible!");
+
+        const auto b = m_bottom.load(std::memory_order_relaxed);
+        const auto t = m_top.load(std::memory_order_acquire);
+        auto& slot = m_data[b & Q_MASK];
+
+        if(b - t >= static_cast<std::int64_t>(Q_SIZE) || slot.busy.load(std::memory_order_acquire))
+            return false;
+
+        new (slot.item()) T (std::move(item));
+        slot.busy.store(true, std::memory_order_relaxed);
+        m_bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*
+     * Owner only. Takes the most recently pushed item.
+     */
+    bool pop(T& item) noexcept
+    {
+        const auto b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = m_top.load(std::memory_order_relaxed);
+
+        if(t > b)
+        {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        if(t == b)
+        {
+            // Last item, race against thieves for it.
+            const auto won = m_top.compare_exchange_strong(
+                        t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            if(!won)
+                return false;
+        }
+
+        take(m_data[b & Q_MASK], item);
+        return true;
+    }
+
+    /*
+     * Any thread. Takes the oldest item, fails on contention.
+     */
+    bool steal(T& item) noexcept
+    {
+        auto t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const auto b = m_bottom.load(std::memory_order_acquire);
+
+        if(t >= b)
+            return false;
+
+        if(!m_top.compare_exchange_strong(
+               t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return false;
+
+        take(m_data[t & Q_MASK], item);
+        return true;
+    }
+
+    bool empty() const noexcept
+    {
+        return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+    }
+
+    unsigned int size() const noexcept
+    {
+        const auto s = m_bottom.load(std::memory_order_relaxed) - m_top.load(std::memory_order_relaxed);
+        return s > 0 ? static_cast<unsigned int>(s) : 0;
+    }
+
+private:
+    struct Slot
+    {
+        alignas(T) unsigned char storage[sizeof(T)];
+        std::atomic_bool busy;
+
+        T* item() noexcept { return std::launder(reinterpret_cast<T*>(storage)); }
+    };
+
+    static void take(Slot& slot, T& item) noexcept
+    {
+        item = std::move(*slot.item());
+        slot.item()->~T();
+        slot.busy.store(false, std::memory_order_release);
+    }
+
+    alignas(64) std::atomic<std::int64_t> m_top;
+    alignas(64) std::atomic<std::int64_t> m_bottom;
+
+    alignas(64) Slot* const m_data;
+};